@@ -0,0 +1,117 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "arduino--.h"
+
+// The Internet checksum (RFC 1071) is the ones' complement of the
+// ones' complement sum of the data as big endian 16 bit words.
+
+// Adds |len| bytes at |p| to the ones' complement sum |sum|. An odd
+// last byte is padded with zero.
+static inline uint16_t inet_sum(const byte *p, uint16_t len, uint16_t sum)
+    {
+#ifdef __AVR__
+    // The carry stays in the flag from one word to the next, and is
+    // only folded back in at the end. dec leaves the carry alone, so
+    // the loop count is 8 bits and longer data is done in chunks.
+    uint16_t words = len >> 1;
+    while (words != 0)
+        {
+        // 0 means 256 to dec/brne.
+        byte n = words > 255 ? 0 : words;
+        byte hi, lo;
+        words -= n == 0 ? 256 : n;
+        __asm__ __volatile__ (
+                  "clc" "\n"
+                  "1:\t" "ld %[hi], %a[p]+" "\n\t"
+                  "ld %[lo], %a[p]+" "\n\t"
+                  "adc %A[sum], %[lo]" "\n\t"
+                  "adc %B[sum], %[hi]" "\n\t"
+                  "dec %[n]" "\n\t"
+                  "brne 1b" "\n\t"
+                  "adc %A[sum], __zero_reg__" "\n\t"
+                  "adc %B[sum], __zero_reg__" "\n\t"
+                  "adc %A[sum], __zero_reg__"
+                  : [sum] "+r" (sum), [p] "+e" (p), [n] "+r" (n),
+                    [hi] "=&r" (hi), [lo] "=&r" (lo)
+                  :
+                  : "memory");
+        }
+#else
+    uint32_t s = sum;
+    for (uint16_t words = len >> 1; words != 0; --words, p += 2)
+        s += (p[0] << 8) | p[1];
+    while (s >> 16)
+        s = (s & 0xffff) + (s >> 16);
+    sum = s;
+#endif
+    if (len & 1)
+        {
+        uint32_t s = sum + ((uint16_t)*p << 8);
+        sum = s + (s >> 16);
+        }
+    return sum;
+    }
+
+// RFC 1624, eqn. 3: the new value of the checksum field |check| when
+// a 16 bit word it covers changes from |old| to |now|.
+static inline uint16_t inet_update(uint16_t check, uint16_t old,
+                                   uint16_t now)
+    {
+    uint32_t s = (uint32_t)(uint16_t)~check + (uint16_t)~old + now;
+    s = (s & 0xffff) + (s >> 16);
+    return ~(s + (s >> 16));
+    }
+
+// Accumulates the checksum of data given in pieces of any length,
+// e.g. as it is written to the ENC28J60 (see ENC28J60::WriteBuffer()).
+class InetChecksum
+    {
+public:
+    InetChecksum(uint16_t sum = 0)
+      : sum_(sum), odd_(false)
+        {}
+
+    void add(byte b)
+        {
+        uint32_t s = sum_ + (odd_ ? b : (uint16_t)b << 8);
+        sum_ = s + (s >> 16);
+        odd_ = !odd_;
+        }
+    void add(const byte *data, uint16_t len)
+        {
+        if (len == 0)
+            return;
+        if (odd_)
+            {
+            add(*data++);
+            --len;
+            }
+        sum_ = inet_sum(data, len, sum_);
+        odd_ = len & 1;
+        }
+    // A 16 bit word, e.g. of a pseudo header.
+    void add16(uint16_t w)
+        {
+        // At an odd offset the bytes land the other way round.
+        if (odd_)
+            w = (w << 8) | (w >> 8);
+        uint32_t s = (uint32_t)sum_ + w;
+        sum_ = s + (s >> 16);
+        }
+
+    // The sum so far.
+    uint16_t sum() const
+        { return sum_; }
+    // The value for the checksum field.
+    uint16_t result() const
+        { return ~sum_; }
+
+private:
+    uint16_t sum_;
+    bool odd_;
+    };
+
+#endif
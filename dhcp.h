@@ -0,0 +1,458 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+
+#ifndef DHCP_H
+#define DHCP_H
+
+#include <stddef.h>
+#include <string.h>
+#include <avr/eeprom.h>
+#include "udp_socket.h"
+
+// Where the last lease is kept, after the RF12 config at 0x20-0x4f.
+#ifndef DHCP_EEPROM_ADDR
+# define DHCP_EEPROM_ADDR 0x60
+#endif
+
+// A DHCP client (RFC 2131), run as a NetStack handler, which never
+// blocks. Initialise the IP layer with 0.0.0.0, put the client in the
+// handler list and start() it:
+//
+//   static uint8_t noip[4];
+//   MyIP::init_ip_arp_udp_tcp(mymac, noip);
+//   net.get<MyDHCP>().start();
+//
+// The lease (address, netmask, router and server) is stored in EEPROM
+// at |eeprom| whenever one is granted. start() asks the server to
+// confirm the stored address straight away, from 0.0.0.0 as RFC 2131
+// 4.1 wants, and takes it back with the ACK, so after a reset a node
+// is reachable again in one round trip instead of a whole DISCOVER
+// exchange. A server that says no, or doesn't answer, after a few
+// tries, sends us back to start from scratch.
+//
+// Servers may broadcast their OFFER, ACK and NAK, so until the client
+// is bound, and while it renews, it has MyIP pass broadcasts (see
+// IP::listen_broadcasts()). It doesn't ask for them with the BOOTP
+// broadcast flag, as unicast to our MAC gets through while our IP is
+// 0.0.0.0.
+//
+// The lease is renewed with the server that granted it halfway
+// through, and from any server at 7/8, as the RFC says. Everything is
+// timed in seconds of |Clock|, so poll() must be called at least once
+// a minute.
+template <class MyIP, class Clock, uint16_t eeprom = DHCP_EEPROM_ADDR>
+  class DHCPClient
+    : public UDPListener<DHCPClient<MyIP, Clock, eeprom>, MyIP, 68>
+    {
+public:
+    enum State
+        {
+        STOPPED,
+        INIT,           // about to send a DISCOVER
+        SELECTING,      // waiting for an OFFER
+        REQUESTING,     // waiting for the ACK of an offer
+        REBOOTING,      // waiting for the ACK of a stored lease
+        BOUND,
+        RENEWING,       // from the server that granted the lease
+        REBINDING       // from any server
+        };
+
+    DHCPClient()
+      : state_(STOPPED), listening_(false)
+        {}
+
+    // Start with the stored lease if there is one for our MAC
+    // address, or else from scratch.
+    void start();
+    State state() const
+        { return state_; }
+    // True if we have an address.
+    bool bound() const
+        { return state_ >= BOUND; }
+
+    void datagramReceived();
+    void idle();
+
+private:
+    typedef UDPEndpoint<MyIP, 68> Endpoint;
+
+    // Message types, option 53.
+    enum { DISCOVER = 1, OFFER, REQUEST, DECLINE, ACK, NAK };
+    // Options.
+    enum
+        {
+        OPT_PAD = 0,
+        OPT_NETMASK = 1,
+        OPT_ROUTER = 3,
+        OPT_REQUESTED_IP = 50,
+        OPT_LEASE_TIME = 51,
+        OPT_MESSAGE_TYPE = 53,
+        OPT_SERVER_ID = 54,
+        OPT_PARAMETERS = 55,
+        OPT_END = 255
+        };
+    // Offsets in a BOOTP message.
+    enum
+        {
+        OP = 0,
+        HTYPE = 1,
+        HLEN = 2,
+        XID = 4,
+        CIADDR = 12,
+        YIADDR = 16,
+        CHADDR = 28,
+        MAGIC = 236,
+        OPTIONS = 240,
+        // Some servers ignore anything shorter.
+        MIN_LENGTH = 300
+        };
+    // Retransmission, in seconds.
+    static const byte FIRST_WAIT = 4;
+    static const byte LAST_WAIT = 64;
+    static const byte TRIES = 4;
+
+    struct Lease
+        {
+        uint8_t ip[4];
+        uint8_t mask[4];
+        uint8_t router[4];
+        uint8_t server[4];
+        // Ties the lease to our MAC address.
+        uint8_t check;
+        };
+
+    void restart();
+    void listen(bool on);
+    void bind(uint32_t leaseTime);
+    void second();
+    void send(byte type);
+    void resend(State state, byte type);
+    uint8_t check() const;
+    void lease(const uint8_t *ip, const uint8_t *mask, const uint8_t *router);
+
+    State state_;
+    Lease lease_;
+    uint8_t xid_[4];
+    // The offer being requested.
+    uint8_t offered_[4];
+    // Seconds since the lease was granted, and when to renew, rebind
+    // and give up.
+    uint32_t elapsed_;
+    uint32_t t1_;
+    uint32_t t2_;
+    uint32_t expiry_;
+    // When the last second was counted.
+    uint16_t lastMillis_;
+    // Seconds until the next retransmission, and the one after.
+    byte wait_;
+    byte backoff_;
+    byte tries_;
+    // Whether we have asked MyIP for broadcasts.
+    bool listening_;
+    };
+
+template <class MyIP, class Clock, uint16_t eeprom>
+  void DHCPClient<MyIP, Clock, eeprom>::start()
+    {
+    lastMillis_ = Clock::millis();
+    eeprom_read_block(&lease_, (const void *)eeprom, sizeof lease_);
+    if (lease_.check != check())
+        {
+        restart();
+        return;
+        }
+
+    // Ask for it on the next idle(), the address is only used once
+    // it is confirmed.
+    listen(true);
+    memcpy(offered_, lease_.ip, 4);
+    tries_ = 0;
+    backoff_ = FIRST_WAIT;
+    state_ = REBOOTING;
+    wait_ = 0;
+    }
+
+// Forget any address, and send a DISCOVER on the next idle().
+template <class MyIP, class Clock, uint16_t eeprom>
+  void DHCPClient<MyIP, Clock, eeprom>::restart()
+    {
+    static const uint8_t none[4] = { 0, 0, 0, 0 };
+
+    listen(true);
+    if (state_ >= REBOOTING)
+        {
+        MyIP::set_ip(none);
+        // Don't come back to it after a reset.
+        eeprom_update_byte((uint8_t *)eeprom + offsetof(Lease, check),
+                           ~check());
+        }
+    tries_ = 0;
+    backoff_ = FIRST_WAIT;
+    state_ = INIT;
+    wait_ = 0;
+    }
+
+template <class MyIP, class Clock, uint16_t eeprom>
+  void DHCPClient<MyIP, Clock, eeprom>::listen(bool on)
+    {
+    if (on != listening_)
+        {
+        listening_ = on;
+        MyIP::listen_broadcasts(on);
+        }
+    }
+
+template <class MyIP, class Clock, uint16_t eeprom>
+  void DHCPClient<MyIP, Clock, eeprom>::datagramReceived()
+    {
+    const byte *d = this->data();
+    uint16_t len = this->dataLength();
+
+    if (state_ <= INIT || state_ == BOUND || len < OPTIONS + 1
+        || d[OP] != 2 || memcmp(&d[XID], xid_, 4) != 0
+        || memcmp(&d[CHADDR], MyIP::my_mac(), 6) != 0
+        || d[MAGIC] != 99 || d[MAGIC+1] != 130 || d[MAGIC+2] != 83
+        || d[MAGIC+3] != 99)
+        return;
+
+    byte type = 0;
+    const byte *server = 0;
+    const byte *mask = 0;
+    const byte *router = 0;
+    uint32_t leaseTime = 0xffffffff;
+
+    for (uint16_t i = OPTIONS; i < len && d[i] != OPT_END; )
+        {
+        if (d[i] == OPT_PAD)
+            {
+            ++i;
+            continue;
+            }
+        if (i + 2 > len || i + 2 + d[i+1] > len)
+            break;
+
+        const byte *v = &d[i+2];
+        byte vlen = d[i+1];
+
+        if (d[i] == OPT_MESSAGE_TYPE && vlen == 1)
+            type = *v;
+        else if (d[i] == OPT_SERVER_ID && vlen == 4)
+            server = v;
+        else if (d[i] == OPT_LEASE_TIME && vlen == 4)
+            leaseTime = MyIP::get_u32(v);
+        else if (d[i] == OPT_NETMASK && vlen == 4)
+            mask = v;
+        else if (d[i] == OPT_ROUTER && vlen >= 4)
+            router = v;
+        i += 2 + vlen;
+        }
+
+    if (state_ == SELECTING)
+        {
+        if (type != OFFER || server == 0)
+            return;
+        memcpy(offered_, &d[YIADDR], 4);
+        memcpy(lease_.server, server, 4);
+        state_ = REQUESTING;
+        tries_ = 0;
+        backoff_ = FIRST_WAIT;
+        resend(REQUESTING, REQUEST);
+        }
+    else if (type == NAK)
+        restart();
+    else if (type == ACK)
+        {
+        static const uint8_t none[4] = { 0, 0, 0, 0 };
+
+        if (server != 0)
+            memcpy(lease_.server, server, 4);
+        lease(&d[YIADDR], mask ? mask : none, router ? router : none);
+        bind(leaseTime);
+        }
+    }
+
+// Take the address in lease_ and store it.
+template <class MyIP, class Clock, uint16_t eeprom>
+  void DHCPClient<MyIP, Clock, eeprom>::lease(const uint8_t *ip,
+                                              const uint8_t *mask,
+                                              const uint8_t *router)
+    {
+    memcpy(lease_.ip, ip, 4);
+    memcpy(lease_.mask, mask, 4);
+    memcpy(lease_.router, router, 4);
+    lease_.check = check();
+    MyIP::set_ip(lease_.ip);
+    MyIP::set_gateway(lease_.router, lease_.mask);
+    // Only written when it changes, so renewals don't wear it out.
+    eeprom_update_block(&lease_, (void *)eeprom, sizeof lease_);
+    }
+
+template <class MyIP, class Clock, uint16_t eeprom>
+  void DHCPClient<MyIP, Clock, eeprom>::bind(uint32_t leaseTime)
+    {
+    elapsed_ = 0;
+    expiry_ = leaseTime;
+    t1_ = leaseTime / 2;
+    t2_ = leaseTime - leaseTime / 8;
+    state_ = BOUND;
+    listen(false);
+    }
+
+template <class MyIP, class Clock, uint16_t eeprom>
+  void DHCPClient<MyIP, Clock, eeprom>::idle()
+    {
+    if (state_ == STOPPED)
+        return;
+
+    uint16_t now = Clock::millis();
+
+    while ((uint16_t)(now - lastMillis_) >= 1000)
+        {
+        lastMillis_ += 1000;
+        second();
+        }
+
+    if (state_ == INIT)
+        {
+        // A new transaction for each DISCOVER, so that late offers
+        // for an old one are ignored.
+        const uint8_t *mac = MyIP::my_mac();
+
+        xid_[0] = mac[3];
+        xid_[1] = mac[4];
+        xid_[2] = mac[5] ^ (now >> 8);
+        xid_[3] = now;
+        resend(SELECTING, DISCOVER);
+        }
+    else if (wait_ == 0)
+        switch (state_)
+            {
+        case SELECTING:
+            resend(SELECTING, DISCOVER);
+            break;
+        case REQUESTING:
+        case REBOOTING:
+            if (tries_ == TRIES)
+                restart();
+            else
+                resend(state_, REQUEST);
+            break;
+        case RENEWING:
+        case REBINDING:
+            resend(state_, REQUEST);
+            break;
+        default:
+            break;
+            }
+    }
+
+// Count a second of the lease and of waiting for an answer.
+template <class MyIP, class Clock, uint16_t eeprom>
+  void DHCPClient<MyIP, Clock, eeprom>::second()
+    {
+    if (wait_ != 0)
+        --wait_;
+    if (state_ < BOUND)
+        return;
+
+    if (++elapsed_ >= expiry_)
+        restart();
+    else if (state_ == BOUND && elapsed_ >= t1_)
+        {
+        // A NAK comes as a broadcast.
+        listen(true);
+        state_ = RENEWING;
+        backoff_ = FIRST_WAIT;
+        wait_ = 0;
+        }
+    else if (state_ == RENEWING && elapsed_ >= t2_)
+        {
+        state_ = REBINDING;
+        backoff_ = FIRST_WAIT;
+        wait_ = 0;
+        }
+    }
+
+// Send |type| now, go to |state|, and wait twice as long as last time
+// (RFC 2131 4.1), give or take a second, before sending it again.
+template <class MyIP, class Clock, uint16_t eeprom>
+  void DHCPClient<MyIP, Clock, eeprom>::resend(State state, byte type)
+    {
+    send(type);
+    state_ = state;
+    ++tries_;
+    wait_ = backoff_ - 1 + (byte)(Clock::millis() ^ MyIP::my_mac()[5]) % 3;
+    if (backoff_ < LAST_WAIT)
+        backoff_ *= 2;
+    }
+
+template <class MyIP, class Clock, uint16_t eeprom>
+  void DHCPClient<MyIP, Clock, eeprom>::send(byte type)
+    {
+    static const uint8_t broadcast[4] = { 0xff, 0xff, 0xff, 0xff };
+    byte *d = this->payload();
+
+    if (this->maxLength() < MIN_LENGTH)
+        return;
+
+    memset(d, 0, MIN_LENGTH);
+    d[OP] = 1;
+    d[HTYPE] = 1;
+    d[HLEN] = 6;
+    memcpy(&d[XID], xid_, 4);
+    memcpy(&d[CHADDR], MyIP::my_mac(), 6);
+    d[MAGIC] = 99;
+    d[MAGIC+1] = 130;
+    d[MAGIC+2] = 83;
+    d[MAGIC+3] = 99;
+
+    byte *o = &d[OPTIONS];
+
+    *o++ = OPT_MESSAGE_TYPE;
+    *o++ = 1;
+    *o++ = type;
+    if (state_ == RENEWING || state_ == REBINDING)
+        // We have the address, and say so in ciaddr.
+        memcpy(&d[CIADDR], lease_.ip, 4);
+    else if (type == REQUEST)
+        {
+        *o++ = OPT_REQUESTED_IP;
+        *o++ = 4;
+        memcpy(o, offered_, 4);
+        o += 4;
+        if (state_ == REQUESTING)
+            {
+            *o++ = OPT_SERVER_ID;
+            *o++ = 4;
+            memcpy(o, lease_.server, 4);
+            o += 4;
+            }
+        }
+    *o++ = OPT_PARAMETERS;
+    *o++ = 3;
+    *o++ = OPT_NETMASK;
+    *o++ = OPT_ROUTER;
+    *o++ = OPT_LEASE_TIME;
+    *o = OPT_END;
+
+    this->setLength(MIN_LENGTH);
+    // Renewals go to the server that granted the lease, the rest to
+    // everyone.
+    Endpoint::sendTo(state_ == RENEWING ? lease_.server : broadcast, 67);
+    }
+
+// Stored leases are only good for our own MAC address.
+template <class MyIP, class Clock, uint16_t eeprom>
+  uint8_t DHCPClient<MyIP, Clock, eeprom>::check() const
+    {
+    const uint8_t *mac = MyIP::my_mac();
+    const uint8_t *p = (const uint8_t *)&lease_;
+    uint8_t sum = 0x5a;
+
+    for (byte i = 0; i < 6; ++i)
+        sum = (sum << 1 | sum >> 7) ^ mac[i];
+    for (byte i = 0; i < offsetof(Lease, check); ++i)
+        sum = (sum << 1 | sum >> 7) ^ p[i];
+    return sum;
+    }
+
+#endif
@@ -20,15 +20,72 @@
 #include "spi.h"
 #include <util/delay.h>
 
-template <class CSPin> class ENC28J60
+// Frames waiting for an ARP reply can be parked in ENC28J60_PARK_SLOTS
+// slots of ENC28J60_PARK_FRAMELEN bytes, and fragmented IP datagrams
+// put back together in ENC28J60_REASM_SLOTS slots of ENC28J60_REASM_LEN
+// bytes, see ENC28J60::Park() and ENC28J60::PacketCopy(). The slots
+// come out of the 6.5 KB receive buffer, so there are none unless
+// they are defined before including this.
+#ifndef ENC28J60_PARK_SLOTS
+# define ENC28J60_PARK_SLOTS 0
+#endif
+#ifndef ENC28J60_PARK_FRAMELEN
+# define ENC28J60_PARK_FRAMELEN 0x300
+#endif
+#ifndef ENC28J60_REASM_SLOTS
+# define ENC28J60_REASM_SLOTS 0
+#endif
+#ifndef ENC28J60_REASM_LEN
+# define ENC28J60_REASM_LEN 0xC00
+#endif
+
+// The chip's INT line (active low), if it is connected to IntPin. We
+// use its pin change interrupt, so the application must call
+// ENC28J60::interrupt() from the matching PCINTn_vect.
+template <class IntPin> class _ENC28J60IntPin
     {
-    static void Select() { CSPin::clear(); }
-    static void Deselect() { CSPin::set(); }
 public:
-    static byte ReadOp(byte op, byte address)
+    static void init()
 	{
-	ScopedInterruptDisable dis;
+	IntPin::modeInputPullup();
+	IntPin::enableChangeInterrupt();
+	}
+    static bool asserted() { return IntPin::read() == 0; }
+    };
+
+// If INT is not connected we can't tell, so assume a packet may be
+// waiting.
+template <> class _ENC28J60IntPin<NullPin>
+    {
+public:
+    static void init() {}
+    static bool asserted() { return true; }
+    };
+
+template <class CSPin, class IntPin = NullPin> class ENC28J60
+    {
+    typedef _ENC28J60IntPin<IntPin> Int;
 
+    typedef SPIDevice<CSPin, SPI_CLOCK_DIV2> Device;
+
+    // Each operation holds the SPI bus. Interrupt handlers don't have
+    // to be disabled, they wait for the bus (see SPIBus).
+    static void Select() { SPIBus::acquire(); Device::select(); }
+    static void Deselect() { Device::deselect(); SPIBus::release(); }
+    // Buffer transfers release the bus every SPI_CHUNK bytes so a
+    // waiting interrupt handler can run within SPI_MAX_HOLD_US. The
+    // buffer pointers auto-increment, so the next chunk just reissues
+    // the command. By estimate, selecting the chip and sending the
+    // command takes 40 cycles, and a byte 32: 16 to shift it at
+    // F_CPU / 2, and the rest for the loop, reading EEPROM in
+    // WriteFrom() being the slowest.
+    static const uint16_t SPI_CHUNK =
+      (SPI_MAX_HOLD_US * (F_CPU / 1000000) - 40) / 32;
+    typedef char SPIMaxHoldTooShort
+      [SPI_MAX_HOLD_US * (F_CPU / 1000000) >= 40 + 8 * 32 ? 1 : -1];
+public:
+    static byte ReadOp(byte op, byte address)
+	{
 	//CSACTIVE;
 	Select();
 	// issue read command
@@ -53,8 +110,6 @@ public:
 	}
     static void WriteOp(uint8_t op, uint8_t address, uint8_t data)
 	{
-	ScopedInterruptDisable dis;
-
 	//CSACTIVE;
 	Select();
 	// issue write command
@@ -70,50 +125,63 @@ public:
 	}
     static void ReadBuffer(uint16_t len, uint8_t* data)
 	{
-	ScopedInterruptDisable dis;
-
-	//CSACTIVE;
-	Select();
-	// issue read command
-	SPDR = ENC28J60_READ_BUF_MEM;
-	//waitspi();
-	SPI::wait();
-	while(len)
+	while (len)
 	    {
-	    len--;
-	    // read data
-	    SPDR = 0x00;
+	    uint16_t n = len < SPI_CHUNK ? len : SPI_CHUNK;
+	    //CSACTIVE;
+	    Select();
+	    // issue read command
+	    SPDR = ENC28J60_READ_BUF_MEM;
 	    //waitspi();
 	    SPI::wait();
-	    *data = SPDR;
-	    data++;
+	    SPI::readBlock(data, n);
+	    //CSPASSIVE;
+	    Deselect();
+	    data += n;
+	    len -= n;
 	    }
-	// FIXME: buffer overrun!!
-	*data='\0';
-	//CSPASSIVE;
-	Deselect();
 	}
-    static void WriteBuffer(uint16_t len, uint8_t* data)
+    static void WriteBuffer(uint16_t len, const uint8_t* data)
 	{
-	ScopedInterruptDisable dis;
-
-	//CSACTIVE;
-	Select();
-	// issue write command
-	SPDR = ENC28J60_WRITE_BUF_MEM;
-	//waitspi();
-	SPI::wait();
-	while(len)
+	NullSink none;
+	WriteBuffer(len, data, none);
+	}
+    // Also passes the data to |sink|.add() as it is written, e.g. to
+    // an InetChecksum.
+    template <class Sink>
+    static void WriteBuffer(uint16_t len, const uint8_t* data, Sink &sink)
+	{
+	while (len)
 	    {
-	    len--;
-	    // write data
-	    SPDR = *data;
-	    data++;
+	    uint16_t n = len < SPI_CHUNK ? len : SPI_CHUNK;
+	    //CSACTIVE;
+	    Select();
+	    // issue write command
+	    SPDR = ENC28J60_WRITE_BUF_MEM;
 	    //waitspi();
 	    SPI::wait();
+	    SPI::writeBlock(data, n, sink);
+	    //CSPASSIVE;
+	    Deselect();
+	    data += n;
+	    len -= n;
+	    }
+	}
+    // Writes |len| bytes from |source|, e.g. a ProgmemSource, passing
+    // them to |sink| too. See _SPI::writeFrom().
+    template <class Source, class Sink>
+    static void WriteFrom(uint16_t len, Source &source, Sink &sink)
+	{
+	while (len)
+	    {
+	    uint16_t n = len < SPI_CHUNK ? len : SPI_CHUNK;
+	    Select();
+	    SPDR = ENC28J60_WRITE_BUF_MEM;
+	    SPI::wait();
+	    SPI::writeFrom(source, n, sink);
+	    Deselect();
+	    len -= n;
 	    }
-	//CSPASSIVE;
-	Deselect();
 	}
     static void SetBank(uint8_t address)
 	{
@@ -161,16 +229,10 @@ public:
 	}
     static void Init(const uint8_t *macaddr)
 	{
-	// initialize I/O
-	//CSPASSIVE; // ss=0
-	Deselect();
-	// ss as output:
-	//pinMode(ENC28J60_CONTROL_CS, OUTPUT);
-	CSPin::modeOutput();
-
+	// initialize I/O: CS high and as output, SPI pins.
 	// Note the old code cleared MOSI and SCK, SPI::init()
 	// currently doesn't.
-	SPI::init(0, true);
+	Device::init();
 
 	// perform system reset
 	WriteOp(ENC28J60_SOFT_RESET, 0, ENC28J60_SOFT_RESET);
@@ -198,21 +260,10 @@ public:
 	// TX end
 	Write(ETXNDL, TXSTOP_INIT&0xFF);
 	Write(ETXNDH, TXSTOP_INIT>>8);
-	// do bank 1 stuff, packet filter:
-	// For broadcast packets we allow only ARP packtets
-	// All other packets should be unicast only for our mac (MAADR)
-	//
-	// The pattern to match on is therefore
-	// Type     ETH.DST
-	// ARP      BROADCAST
-	// 06 08 -- ff ff ff ff ff ff -> ip checksum for theses bytes=f7f9
-	// in binary these poitions are:11 0000 0011 1111
-	// This is hex 303F->EPMM0=0x3f,EPMM1=0x30
-	Write(ERXFCON, ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_PMEN);
-	Write(EPMM0, 0x3f);
-	Write(EPMM1, 0x30);
-	Write(EPMCSL, 0xf9);
-	Write(EPMCSH, 0xf7);
+	TxFirst = TxCount = 0;
+	TxBusy = false;
+	// do bank 1 stuff, packet filter
+	FilterUnicastAndArpBroadcasts();
     
 	// do bank 2 stuff
 	// enable MAC receive
@@ -245,32 +296,321 @@ public:
 	// switch to bank 0
 	SetBank(ECON1);
 	// enable interrutps
+	Int::init();
 	WriteOp(ENC28J60_BIT_FIELD_SET, EIE, EIE_INTIE | EIE_PKTIE);
 	// enable packet reception
 	WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXEN);
 	}
+    // Receive filters, see datasheet section 8. A packet is accepted
+    // if any of the enabled filters accepts it, or if all of them do
+    // when FILTER_AND is set. FILTER_CRC rejects bad CRCs either way.
+    enum Filter
+	{
+	FILTER_UNICAST = 0x80,    // destination is our MAC
+	FILTER_AND = 0x40,
+	FILTER_CRC = 0x20,
+	FILTER_PATTERN = 0x10,    // see SetPattern()
+	FILTER_MAGIC_PACKET = 0x08,
+	FILTER_HASH = 0x04,       // see SetHashTable() and AddHash()
+	FILTER_MULTICAST = 0x02,
+	FILTER_BROADCAST = 0x01,
+	};
+    // |filters| is a combination of Filter values.
+    static void SetFilter(uint8_t filters)
+	{ Write(ERXFCON, filters); }
+    // Set the pattern match filter. Bit n of |mask| selects byte n
+    // of the 64 bytes starting at |offset| (which must be even) in
+    // the packet, |pattern| has the |len| values the selected bytes
+    // must have, in order.
+    static void SetPattern(uint16_t offset, const uint8_t mask[8],
+			   const uint8_t *pattern, uint8_t len)
+	{
+	// The chip compares an IP style checksum of the selected bytes.
+	uint32_t sum = 0;
+	for (uint8_t i = 0; i < len; i += 2)
+	    sum += (pattern[i] << 8) | (i + 1 < len ? pattern[i + 1] : 0);
+	while (sum >> 16)
+	    sum = (sum & 0xFFFF) + (sum >> 16);
+	sum ^= 0xFFFF;
+	for (uint8_t i = 0; i < 8; ++i)
+	    Write(EPMM0 + i, mask[i]);
+	Write(EPMCSL, sum);
+	Write(EPMCSH, sum >> 8);
+	Write(EPMOL, offset);
+	Write(EPMOH, offset >> 8);
+	}
+    // Accept unicast packets for our MAC and broadcast ARP packets,
+    // which is what Init() sets up.
+    static void FilterUnicastAndArpBroadcasts()
+	{
+	// For broadcast packets we allow only ARP packtets
+	// All other packets should be unicast only for our mac (MAADR)
+	//
+	// The pattern to match on is therefore
+	// Type     ETH.DST
+	// ARP      BROADCAST
+	// 06 08 -- ff ff ff ff ff ff -> ip checksum for theses bytes=f7f9
+	// in binary these poitions are:11 0000 0011 1111
+	// This is hex 303F->EPMM0=0x3f,EPMM1=0x30
+	static const uint8_t mask[8] = { 0x3f, 0x30 };
+	static const uint8_t pattern[8] =
+	    { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x08, 0x06 };
+	SetPattern(0, mask, pattern, sizeof pattern);
+	SetFilter(FILTER_UNICAST | FILTER_CRC | FILTER_PATTERN);
+	}
+    // Accept unicast packets for our MAC and all broadcasts, e.g.
+    // for DHCP.
+    static void FilterUnicastAndBroadcast()
+	{
+	SetFilter(FILTER_UNICAST | FILTER_CRC | FILTER_BROADCAST);
+	}
+    // Accept only unicast packets for our MAC and ARP requests for
+    // |ip|. All other broadcasts and multicasts are dropped by the
+    // chip without waking us up.
+    static void FilterUnicastAndArp(const uint8_t ip[4])
+	{
+	// Type  ETH.DST              ARP.DST_IP
+	// 08 06 ff ff ff ff ff ff    ip[0..3]
+	// bytes 0-5, 12-13 and 38-41
+	static const uint8_t mask[8] = { 0x3f, 0x30, 0, 0, 0xc0, 0x03 };
+	uint8_t pattern[12] =
+	    { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x08, 0x06 };
+	for (uint8_t i = 0; i < 4; ++i)
+	    pattern[8 + i] = ip[i];
+	SetPattern(0, mask, pattern, sizeof pattern);
+	SetFilter(FILTER_UNICAST | FILTER_CRC | FILTER_PATTERN);
+	}
+    // The hash table filter accepts packets whose destination MAC
+    // hashes to a set bit in the 64 bit table.
+    static void SetHashTable(const uint8_t table[8])
+	{
+	for (uint8_t i = 0; i < 8; ++i)
+	    Write(EHT0 + i, table[i]);
+	}
+    // Set the hash table bit for |mac|, e.g. a multicast group.
+    static void AddHash(const uint8_t mac[6])
+	{
+	// The pointer is bits 28:23 of the CRC-32 of the MAC, see
+	// datasheet section 8.3.
+	uint32_t crc = 0xFFFFFFFF;
+	for (uint8_t i = 0; i < 6; ++i)
+	    {
+	    uint8_t b = mac[i];
+	    for (uint8_t j = 0; j < 8; ++j)
+		{
+		bool xor_ = ((crc >> 31) ^ b) & 1;
+		crc <<= 1;
+		if (xor_)
+		    crc ^= 0x04C11DB7;
+		b >>= 1;
+		}
+	    }
+	uint8_t reg = EHT0 + ((crc >> 26) & 0x07);
+	Write(reg, Read(reg) | (1 << ((crc >> 23) & 0x07)));
+	}
+
     // read the revision of the chip:
     static uint8_t getrev(void)
 	{
 	return Read(EREVID);
 	}
-    static void PacketSend(uint16_t len, uint8_t* packet)
+    // Sends a packet, waiting only until there is room for it in the
+    // transmit queue. Returns false, sending nothing, if it is too long
+    // for the transmit buffer.
+    static bool PacketSend(uint16_t len, uint8_t* packet)
+	{
+	if (!TxFits(len))
+	    return false;
+	while (!SendQueued(len, packet))
+	    ;
+	return true;
+	}
+    // True if a frame of |len| bytes fits in the transmit buffer once
+    // it is empty. TxBegin() never succeeds for a longer one.
+    static bool TxFits(uint16_t len)
+	{ return len <= TXSTOP_INIT + 1 - TXSTART_INIT - TX_OVERHEAD; }
+    // The transmit buffer holds up to TX_FRAMES frames, which the chip
+    // sends one after another. Queueing a frame doesn't wait for the
+    // previous one to go out, so e.g. an ACK and the data following it
+    // can be written back to back.
+    //
+    // Returns true if a frame of |len| bytes can be queued right now.
+    static bool CanSend(uint16_t len)
+	{
+	TxPoll();
+	return TxAllocate(len) != 0;
+	}
+    // Queues a packet for sending, returning false if there is no room.
+    static bool SendQueued(uint16_t len, uint8_t* packet)
 	{
-	// Set the write pointer to start of transmit buffer area
-	Write(EWRPTL, TXSTART_INIT&0xFF);
-	Write(EWRPTH, TXSTART_INIT>>8);
-	// Set the TXND pointer to correspond to the packet size given
-	Write(ETXNDL, (TXSTART_INIT+len)&0xFF);
-	Write(ETXNDH, (TXSTART_INIT+len)>>8);
+	if (!TxBegin(len))
+	    return false;
+	WriteBuffer(len, packet);
+	TxEnd(len);
+	return true;
+	}
+    // Reserves a frame of up to |maxlen| bytes at the end of the
+    // transmit queue and points the write pointer at it, so it can be
+    // filled with WriteBuffer(). Nothing else may write to the chip's
+    // buffer until the frame is queued with TxEnd().
+    static bool TxBegin(uint16_t maxlen)
+	{
+	TxPoll();
+	uint16_t start = TxAllocate(maxlen);
+	if (start == 0)
+	    return false;
+	TxReserved = start;
+	Write(EWRPTL, start&0xFF);
+	Write(EWRPTH, start>>8);
 	// write per-packet control byte (0x00 means use macon3 settings)
 	WriteOp(ENC28J60_WRITE_BUF_MEM, 0, 0x00);
-	// copy the packet into the transmit buffer
+	return true;
+	}
+    // The Internet checksum of |len| bytes at |offset| into the frame
+    // reserved by TxBegin(), worked out by the chip's DMA so the MCU
+    // doesn't have to go over the data again. The result is ready to
+    // be put in a checksum field, high byte first.
+    static uint16_t TxChecksum(uint16_t offset, uint16_t len)
+	{
+	if (len == 0)
+	    return 0xFFFF;
+	// skip the control byte
+	uint16_t start = TxReserved + 1 + offset;
+	uint16_t end = start + len - 1;
+	Write(EDMASTL, start&0xFF);
+	Write(EDMASTH, start>>8);
+	Write(EDMANDL, end&0xFF);
+	Write(EDMANDH, end>>8);
+	// A packet received while the DMA sums can make the checksum
+	// wrong. See Rev. B7 Silicon Errata point 15 (DMA). So reception
+	// is turned off, once the packet coming in, if any, is in, for as
+	// long as this takes. Frames sent to us meanwhile are lost.
+	WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_RXEN);
+	while (ReadOp(ENC28J60_READ_CTRL_REG, ESTAT) & ESTAT_RXBUSY)
+	    ;
+	WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_CSUMEN|ECON1_DMAST);
+	while (ReadOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST)
+	    ;
+	WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_CSUMEN);
+	WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_RXEN);
+	return (Read(EDMACSH) << 8) | Read(EDMACSL);
+	}
+    // Overwrite the 16 bit value at |offset| into the frame reserved
+    // by TxBegin(), high byte first, e.g. to fill in a checksum.
+    static void TxPatch(uint16_t offset, uint16_t value)
+	{
+	uint16_t at = TxReserved + 1 + offset;
+	Write(EWRPTL, at&0xFF);
+	Write(EWRPTH, at>>8);
+	WriteOp(ENC28J60_WRITE_BUF_MEM, 0, value>>8);
+	WriteOp(ENC28J60_WRITE_BUF_MEM, 0, value&0xFF);
+	}
+    // A frame which can't be sent yet, e.g. until the MAC address it
+    // goes to is known, can be parked in one of PARK_SLOTS slots of up
+    // to PARK_FRAMELEN bytes between the receive and transmit buffers,
+    // so it doesn't take up any RAM. Returns false if it is too long.
+    // Two slots of 768 bytes hold a frame for each of two hosts.
+    static const uint8_t PARK_SLOTS = ENC28J60_PARK_SLOTS;
+    static const uint16_t PARK_FRAMELEN = ENC28J60_PARK_FRAMELEN;
+    static bool Park(uint8_t slot, uint16_t len, const uint8_t *packet)
+	{
+	if (len > PARK_FRAMELEN)
+	    return false;
+	uint16_t at = PARKSTART + slot * PARK_FRAMELEN;
+	Write(EWRPTL, at&0xFF);
+	Write(EWRPTH, at>>8);
 	WriteBuffer(len, packet);
+	ParkLen[slot] = len;
+	return true;
+	}
+    // Queues the frame parked in |slot|, with |dst_mac| as its
+    // destination. The frame is copied by the chip's DMA.
+    static void Unpark(uint8_t slot, const uint8_t dst_mac[6])
+	{
+	uint16_t len = ParkLen[slot];
+	if (len == 0)
+	    return;
+	while (!TxBegin(len))
+	    ;
+	uint16_t start = PARKSTART + slot * PARK_FRAMELEN;
+	Copy(start, start + len - 1, TxReserved + 1);
+	// the write pointer is still just after the control byte
+	WriteBuffer(6, dst_mac);
+	TxEnd(len);
+	ParkLen[slot] = 0;
+	}
+    // Forgets the frame parked in |slot|.
+    static void Discard(uint8_t slot)
+	{
+	ParkLen[slot] = 0;
+	}
+    // The fragments of an IP datagram are put back together in one of
+    // REASM_SLOTS slots of REASM_LEN bytes, below the parked frames,
+    // so a datagram can be bigger than a frame without taking up RAM.
+    // One slot of 3 KB, with two parked frames, leaves 2 KB of receive
+    // buffer, room for one full frame and some small ones. Two
+    // datagrams can be put together at once with two slots of half
+    // the size.
+    static const uint8_t REASM_SLOTS = ENC28J60_REASM_SLOTS;
+    static const uint16_t REASM_LEN = ENC28J60_REASM_LEN;
+    // Copies |len| bytes of the current packet, from |offset| on, to
+    // |to| in reassembly |slot|, with the chip's DMA.
+    static void PacketCopy(uint16_t offset, uint16_t len, uint8_t slot,
+			   uint16_t to)
+	{
+	uint16_t start = Wrap(CurrentPacketPtr + offset);
+	// The DMA wraps at the end of the receive buffer too.
+	Copy(start, Wrap(start + len - 1), REASMSTART + slot * REASM_LEN + to);
+	}
+    // Reads |len| bytes from |offset| on in reassembly |slot|.
+    static void ReassemblyRead(uint8_t slot, uint16_t offset, uint16_t len,
+			       uint8_t *data)
+	{
+	SetReadPointer(REASMSTART + slot * REASM_LEN + offset);
+	ReadBuffer(len, data);
+	}
+    // Queues the frame reserved by TxBegin(), which is |len| bytes long.
+    static void TxEnd(uint16_t len)
+	{
+	TxFrame &f = TxQueue[(TxFirst + TxCount) % TX_FRAMES];
+	f.start = TxReserved;
+	f.end = TxReserved + len;
+	++TxCount;
+	TxPoll();
+	}
+    // Retires the frame being sent once the chip is done with it, and
+    // starts sending the next one. Called by the functions above, but
+    // should also be called from the main loop if frames are queued.
+    static void TxPoll()
+	{
+	if (TxBusy)
+	    {
+	    if (!(ReadOp(ENC28J60_READ_CTRL_REG, EIR) & (EIR_TXIF | EIR_TXERIF)))
+		return;
+	    // Reset the transmit logic problem. See Rev. B4 Silicon
+	    // Errata point 12.
+	    WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
+	    TxBusy = false;
+	    TxFirst = (TxFirst + 1) % TX_FRAMES;
+	    --TxCount;
+	    }
+	if (TxCount == 0)
+	    return;
+	const TxFrame &f = TxQueue[TxFirst];
+	Write(ETXSTL, f.start&0xFF);
+	Write(ETXSTH, f.start>>8);
+	Write(ETXNDL, f.end&0xFF);
+	Write(ETXNDH, f.end>>8);
+	WriteOp(ENC28J60_BIT_FIELD_CLR, EIR, EIR_TXIF | EIR_TXERIF);
 	// send the contents of the transmit buffer onto the network
 	WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_TXRTS);
-	// Reset the transmit logic problem. See Rev. B4 Silicon Errata point 12.
-	if(Read(EIR) & EIR_TXERIF)
-	    WriteOp(ENC28J60_BIT_FIELD_CLR, ECON1, ECON1_TXRTS);
+	TxBusy = true;
+	}
+    // Number of frames queued or being sent.
+    static uint8_t TxPending()
+	{
+	TxPoll();
+	return TxCount;
 	}
     // Gets a packet from the network receive buffer, if one is available.
     // The packet will by headed by an ethernet header.
@@ -278,52 +618,141 @@ public:
     //      packet  Pointer where packet data should be stored.
     // Returns: Packet length in bytes if a packet was retrieved, zero otherwise.
     static uint16_t PacketReceive(uint16_t maxlen, uint8_t* packet)
+	{
+	uint16_t len = PacketBegin(0, packet);
+	if (len == 0)
+	    return 0;
+	// limit retrieve length
+	if (len > maxlen-1)
+	    len=maxlen-1;
+	// copy the packet from the receive buffer
+	ReadBuffer(len, packet);
+	packet[len] = '\0';
+	PacketEnd();
+	return len;
+	}
+
+    // Zero copy receive. PacketBegin() looks at the next packet, if
+    // there is one, and copies at most its first |hdrlen| bytes
+    // (normally just the headers) into |packet|. The rest of the
+    // packet stays in the chip: read as much of it as is needed with
+    // PacketRead() or a Cursor, then free it with PacketEnd(). There
+    // can only be one packet in progress at a time.
+    // Returns: the length of the whole packet, zero if there is no
+    // (valid) packet, in which case PacketEnd() must not be called.
+    static uint16_t PacketBegin(uint16_t hdrlen, uint8_t *packet)
 	{
 	uint16_t rxstat;
-	uint16_t len;
+	// Keep queued frames going out while we're polling for input.
+	TxPoll();
 	// check if a packet has been received and buffered
 	//if( !(enc28j60Read(EIR) & EIR_PKTIF) ){
 	// The above does not work. See Rev. B4 Silicon Errata point 6.
+	// Clear the latch first, so a packet arriving after we've
+	// looked sets it again.
+	PacketPending = false;
 	if (Read(EPKTCNT) == 0)
 	    return 0;
-	
+
 	// Set the read pointer to the start of the received packet
-	Write(ERDPTL, (NextPacketPtr));
-	Write(ERDPTH, (NextPacketPtr)>>8);
+	SetReadPointer(NextPacketPtr);
 	// read the next packet pointer
+	CurrentPacketPtr = NextPacketPtr;
 	NextPacketPtr  = ReadOp(ENC28J60_READ_BUF_MEM, 0);
 	NextPacketPtr |= ReadOp(ENC28J60_READ_BUF_MEM, 0)<<8;
 	// read the packet length (see datasheet page 43)
-	len  = ReadOp(ENC28J60_READ_BUF_MEM, 0);
-	len |= ReadOp(ENC28J60_READ_BUF_MEM, 0)<<8;
-	len -= 4; //remove the CRC count
+	CurrentLen  = ReadOp(ENC28J60_READ_BUF_MEM, 0);
+	CurrentLen |= ReadOp(ENC28J60_READ_BUF_MEM, 0)<<8;
+	CurrentLen -= 4; //remove the CRC count
 	// read the receive status (see datasheet page 43)
 	rxstat  = ReadOp(ENC28J60_READ_BUF_MEM, 0);
 	rxstat |= ReadOp(ENC28J60_READ_BUF_MEM, 0)<<8;
-	// limit retrieve length
-	if (len > maxlen-1)
-	    len=maxlen-1;
+	// the packet data follows the 6 byte status vector
+	CurrentPacketPtr = Wrap(CurrentPacketPtr + 6);
 	// check CRC and symbol errors (see datasheet page 44, table 7-3):
 	// The ERXFCON.CRCEN is set by default. Normally we should not
 	// need to check this.
-	if ((rxstat & 0x80) == 0)
+	if ((rxstat & 0x80) == 0 || CurrentLen == 0)
 	    {
 	    // invalid
-	    len=0;
-	    }
-	else
-	    {
-	    // copy the packet from the receive buffer
-	    ReadBuffer(len, packet);
+	    PacketEnd();
+	    return 0;
 	    }
+	if (hdrlen > CurrentLen)
+	    hdrlen = CurrentLen;
+	ReadBuffer(hdrlen, packet);
+	return CurrentLen;
+	}
+    // Read the next |len| bytes of the current packet, continuing
+    // from where the last read left off.
+    static void PacketRead(uint16_t len, uint8_t *data)
+	{ ReadBuffer(len, data); }
+    // Move the read pointer to |offset| bytes into the current packet.
+    static void PacketSeek(uint16_t offset)
+	{ SetReadPointer(Wrap(CurrentPacketPtr + offset)); }
+    // Free the current packet without reading any more of it.
+    static void PacketEnd()
+	{
 	// Move the RX read pointer to the start of the next received packet
 	// This frees the memory we just read out
 	Write(ERXRDPTL, (NextPacketPtr));
 	Write(ERXRDPTH, (NextPacketPtr)>>8);
 	// decrement the packet counter indicate we are done with this packet
 	WriteOp(ENC28J60_BIT_FIELD_SET, ECON2, ECON2_PKTDEC);
-	return len;
 	}
+
+    // Call from the pin change interrupt for IntPin.
+    static void interrupt()
+	{
+	if (Int::asserted())
+	    PacketPending = true;
+	}
+    // True if there may be a packet to receive. Without an IntPin
+    // this is always true. Call with interrupts disabled if you are
+    // going to sleep when it returns false, see
+    // live/star_slave_onewire.cc. Also true while frames are waiting
+    // to be sent, since the transmit queue is only advanced by polling.
+    static bool pollNeeded()
+	{ return PacketPending || Int::asserted() || TxCount != 0; }
+
+    // Reads the current packet (see PacketBegin()) on demand. The
+    // chip has only one read pointer, so each read seeks first and
+    // cursors can be freely mixed.
+    class Cursor
+	{
+    public:
+	explicit Cursor(uint16_t offset = 0)
+	  : offset_(offset)
+	    {}
+	uint16_t offset() const
+	    { return offset_; }
+	uint16_t remaining() const
+	    { return offset_ < CurrentLen ? CurrentLen - offset_ : 0; }
+	void skip(uint16_t len)
+	    { offset_ += len; }
+	// Returns: the number of bytes actually read, which is less
+	// than |len| at the end of the packet.
+	uint16_t read(uint16_t len, uint8_t *data)
+	    {
+	    if (len > remaining())
+		len = remaining();
+	    PacketSeek(offset_);
+	    ReadBuffer(len, data);
+	    offset_ += len;
+	    return len;
+	    }
+	int read()
+	    {
+	    uint8_t c;
+	    if (read(1, &c) == 0)
+		return -1;
+	    return c;
+	    }
+
+    private:
+	uint16_t offset_;
+	};
+
     static void phlcon(uint16_t val) { PhyWrite(PHLCON, val); }
     static void setup(const byte *mac)
 	{
@@ -361,12 +790,44 @@ public:
 	}
 
 private:
+    static void SetReadPointer(uint16_t address)
+	{
+	Write(ERDPTL, address);
+	Write(ERDPTH, address>>8);
+	}
+    // Copies the chip's memory from |start| to |end| inclusive to |to|.
+    static void Copy(uint16_t start, uint16_t end, uint16_t to)
+	{
+	Write(EDMASTL, start&0xFF);
+	Write(EDMASTH, start>>8);
+	Write(EDMANDL, end&0xFF);
+	Write(EDMANDH, end>>8);
+	Write(EDMADSTL, to&0xFF);
+	Write(EDMADSTH, to>>8);
+	WriteOp(ENC28J60_BIT_FIELD_SET, ECON1, ECON1_DMAST);
+	while (ReadOp(ENC28J60_READ_CTRL_REG, ECON1) & ECON1_DMAST)
+	    ;
+	}
+    // Receive buffer addresses wrap from RXSTOP_INIT to RXSTART_INIT.
+    static uint16_t Wrap(uint16_t address)
+	{
+	if (address > RXSTOP_INIT)
+	    address -= RXSTOP_INIT - RXSTART_INIT + 1;
+	return address;
+	}
+
     static const byte ADDR_MASK = 0x1f;
     static const byte BANK_MASK = 0x60;
     static const byte RXSTART_INIT = 0x0;
-    static const uint16_t RXSTOP_INIT = 0x1FFF-0x0600-1;
     static const uint16_t TXSTART_INIT = 0x1FFF-0x0600;
+    static const uint16_t PARKSTART = TXSTART_INIT-PARK_SLOTS*PARK_FRAMELEN;
+    static const uint16_t REASMSTART = PARKSTART-REASM_SLOTS*REASM_LEN;
+    static const uint16_t RXSTOP_INIT = REASMSTART-1;
     static const uint16_t TXSTOP_INIT = 0x1FFF;
+    // The receive buffer has to hold at least one full frame.
+    typedef char ReceiveBufferTooSmall
+      [PARKSTART <= TXSTART_INIT && REASMSTART <= PARKSTART
+       && RXSTOP_INIT + 1 - RXSTART_INIT >= 0x600 ? 1 : -1];
     static const uint16_t MAX_FRAMELEN = 1500;  // (note: maximum ethernet frame
     enum Opcode
 	{
@@ -384,6 +845,7 @@ private:
 	PHLCON = 0x14,
 	EIE = 0x1B,
 	EIR = 0x1C,
+	ESTAT = 0x1D,
 	ECON2 = 0x1E,
 	ECON1 = 0x1F,
 	ERDPTL =   (0x00|0x00),
@@ -400,10 +862,20 @@ private:
 	ERXNDH =   (0x0B|0x00),
 	ERXRDPTL = (0x0C|0x00),
 	ERXRDPTH = (0x0D|0x00),
+	EDMASTL =  (0x10|0x00),
+	EDMASTH =  (0x11|0x00),
+	EDMANDL =  (0x12|0x00),
+	EDMANDH =  (0x13|0x00),
+	EDMADSTL = (0x14|0x00),
+	EDMADSTH = (0x15|0x00),
+	EDMACSL =  (0x16|0x00),
+	EDMACSH =  (0x17|0x00),
+	EHT0 =     (0x00|0x20),
 	EPMM0 =    (0x08|0x20),
-	EPMM1 =    (0x09|0x20),
 	EPMCSL =   (0x10|0x20),
 	EPMCSH =   (0x11|0x20),
+	EPMOL =    (0x14|0x20),
+	EPMOH =    (0x15|0x20),
 	ERXFCON =  (0x18|0x20),
 	EPKTCNT =  (0x19|0x20),
 	ECOCON =   (0x15|0x60),
@@ -429,11 +901,17 @@ private:
 	};
     enum ECON1Bit
 	{
+	ECON1_DMAST = 0x20,
+	ECON1_CSUMEN = 0x10,
 	ECON1_TXRTS = 0x08,
 	ECON1_RXEN = 0x04,
 	ECON1_BSEL1 = 0x02,
 	ECON1_BSEL0 = 0x01,
 	};
+    enum ESTATBit
+	{
+	ESTAT_RXBUSY = 0x04,
+	};
     enum ECON2Bit
 	{
 	ECON2_PKTDEC = 0x40,
@@ -442,12 +920,6 @@ private:
 	{
 	MISTAT_BUSY = 0x01,
 	};
-    enum ERXFCONBit
-	{
-	ERXFCON_UCEN = 0x80,
-	ERXFCON_CRCEN = 0x20,
-	ERXFCON_PMEN = 0x10,
-	};
     enum MACON1Bit
 	{
 	MACON1_TXPAUS = 0x08,
@@ -471,12 +943,76 @@ private:
 	};
     enum EIRBit
 	{
+	EIR_TXIF = 0x08,
 	EIR_TXERIF = 0x02,
 	};
 
     static byte Enc28j60Bank;
     static uint16_t NextPacketPtr;
+    static uint16_t CurrentPacketPtr;
+    static uint16_t CurrentLen;
+    static volatile bool PacketPending;
+
+    // Frames in the transmit buffer. |start| is the control byte and
+    // |end| the last byte of the frame; the chip writes a 7 byte status
+    // vector after it.
+    struct TxFrame
+	{
+	uint16_t start;
+	uint16_t end;
+	};
+    static const uint8_t TX_FRAMES = 4;
+    static const uint8_t TX_OVERHEAD = 1 + 7;
+    // Parked frames have to fit, see Unpark().
+    typedef char ParkFrameTooLong
+      [PARK_FRAMELEN + TX_OVERHEAD <= TXSTOP_INIT + 1 - TXSTART_INIT ? 1 : -1];
+    static TxFrame TxQueue[TX_FRAMES];
+    static uint8_t TxFirst;
+    static uint8_t TxCount;
+    static bool TxBusy;
+    static uint16_t TxReserved;
+    static uint16_t ParkLen[PARK_SLOTS];
+
+    // Finds room for a |len| byte frame after the newest queued frame,
+    // wrapping to the start of the buffer if it doesn't fit before the
+    // end. Frames are never split. Returns 0 if there is no room.
+    static uint16_t TxAllocate(uint16_t len)
+	{
+	uint16_t need = len + TX_OVERHEAD;
+	if (TxCount == TX_FRAMES)
+	    return 0;
+	if (TxCount == 0)
+	    return need <= TXSTOP_INIT + 1 - TXSTART_INIT ? TXSTART_INIT : 0;
+	uint16_t oldest = TxQueue[TxFirst].start;
+	uint16_t next = TxQueue[(TxFirst + TxCount - 1) % TX_FRAMES].end
+	  + TX_OVERHEAD;
+	if (next > oldest)
+	    {
+	    if (need <= TXSTOP_INIT + 1 - next)
+		return next;
+	    next = TXSTART_INIT;
+	    }
+	if (need <= oldest - next)
+	    return next;
+	return 0;
+	}
     };
 
-template<class Pin> byte ENC28J60<Pin>::Enc28j60Bank;
-template<class Pin> uint16_t ENC28J60<Pin>::NextPacketPtr;
+template<class Pin, class IntPin> byte ENC28J60<Pin, IntPin>::Enc28j60Bank;
+template<class Pin, class IntPin>
+  uint16_t ENC28J60<Pin, IntPin>::NextPacketPtr;
+template<class Pin, class IntPin>
+  uint16_t ENC28J60<Pin, IntPin>::CurrentPacketPtr;
+template<class Pin, class IntPin>
+  uint16_t ENC28J60<Pin, IntPin>::CurrentLen;
+template<class Pin, class IntPin>
+  volatile bool ENC28J60<Pin, IntPin>::PacketPending;
+template<class Pin, class IntPin>
+  typename ENC28J60<Pin, IntPin>::TxFrame
+  ENC28J60<Pin, IntPin>::TxQueue[TX_FRAMES];
+template<class Pin, class IntPin> uint8_t ENC28J60<Pin, IntPin>::TxFirst;
+template<class Pin, class IntPin> uint8_t ENC28J60<Pin, IntPin>::TxCount;
+template<class Pin, class IntPin> bool ENC28J60<Pin, IntPin>::TxBusy;
+template<class Pin, class IntPin> uint16_t ENC28J60<Pin, IntPin>::TxReserved;
+template<class Pin, class IntPin>
+  uint16_t ENC28J60<Pin, IntPin>::ParkLen[PARK_SLOTS];
@@ -0,0 +1,57 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+// Frame buffers are taken from one pool rather than each server,
+// socket or NetStack having its own, so that they can share the RAM.
+// Each holds NET_BUFFER_SIZE bytes, which limits the largest Ethernet
+// frame anything receives or sends, and there are NET_BUFFERS of
+// them, at most 8. Define either before including any of the network
+// headers to change them.
+#ifndef NET_BUFFER_SIZE
+# define NET_BUFFER_SIZE 1000
+#endif
+#ifndef NET_BUFFERS
+# define NET_BUFFERS 1
+#endif
+
+template <uint16_t size, byte count> class _FramePool
+    {
+public:
+    static const uint16_t FRAME_SIZE = size;
+
+    // A free frame of FRAME_SIZE bytes, plus one for the '\0'
+    // PacketReceiveForUs() puts after the packet, or 0 if all of them
+    // are borrowed.
+    static byte *borrow()
+        {
+        for (byte i = 0; i < count; ++i)
+            if (!(used_ & (1 << i)))
+                {
+                used_ |= 1 << i;
+                return frames_[i];
+                }
+        return 0;
+        }
+    static void giveBack(byte *frame)
+        {
+        for (byte i = 0; i < count; ++i)
+            if (frame == frames_[i])
+                used_ &= ~(1 << i);
+        }
+
+private:
+    static byte frames_[count][size + 1];
+    // A bit for each frame that is borrowed.
+    static byte used_;
+    typedef char BadCount[count >= 1 && count <= 8 ? 1 : -1];
+    };
+
+template <uint16_t size, byte count>
+  byte _FramePool<size, count>::frames_[count][size + 1];
+template <uint16_t size, byte count> byte _FramePool<size, count>::used_;
+
+typedef _FramePool<NET_BUFFER_SIZE, NET_BUFFERS> FramePool;
+
+#endif
@@ -0,0 +1,533 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <avr/pgmspace.h>
+
+// HTTP/1.1 on a TCPServer or TCPListener (include tcp_server.h
+// first). Requests are parsed a byte at a time as segments arrive,
+// without copying them anywhere, and the path is looked up in a
+// table of routes as it goes. Responses are streamed, so they are
+// retransmitted if lost, chunked for HTTP/1.1 clients, and the
+// connection is kept open for the next request unless the client
+// asks for it to be closed. E.g.
+//
+//   class MyWeb : public HTTPServer<MyWeb, TCPServer<MyWeb, MyIP, 80,
+//                                                    Clock16> >
+//       {
+//   public:
+//       enum { ROOT, METRICS };
+//       static const char *const ROUTES[];
+//
+//       uint16_t body(byte conn, uint32_t offset, byte *data,
+//                     uint16_t maxlen);
+//       };
+//
+//   static const char root[] PROGMEM = "/";
+//   static const char metrics[] PROGMEM = "/metrics";
+//   const char *const MyWeb::ROUTES[] PROGMEM = { root, metrics, 0 };
+//
+// ROUTES is a table of up to 16 paths, all in PROGMEM, ending with
+// 0. A request matches a route if its path, up to any '?', is the
+// same. Any query is ignored.
+
+static const char http_get[] PROGMEM = "GET";
+static const char http_head[] PROGMEM = "HEAD";
+static const char http_post[] PROGMEM = "POST";
+static const char *const http_methods[] PROGMEM =
+    { http_get, http_head, http_post, 0 };
+
+static const char http_10[] PROGMEM = "HTTP/1.0";
+static const char http_11[] PROGMEM = "HTTP/1.1";
+static const char *const http_versions[] PROGMEM = { http_10, http_11, 0 };
+
+// Header names and values we look for, in lower case.
+static const char http_connection[] PROGMEM = "connection";
+static const char http_content_length[] PROGMEM = "content-length";
+static const char *const http_headers[] PROGMEM =
+    { http_connection, http_content_length, 0 };
+
+static const char http_close[] PROGMEM = "close";
+static const char http_keep_alive[] PROGMEM = "keep-alive";
+static const char *const http_connection_values[] PROGMEM =
+    { http_close, http_keep_alive, 0 };
+
+// The state of one request being parsed.
+class HTTPRequest
+    {
+public:
+    // The order of http_methods.
+    enum Method
+        {
+        GET,
+        HEAD,
+        POST,
+        OTHER,
+        };
+    // route() if nothing in the table matched.
+    static const byte NO_ROUTE = 0xff;
+
+    HTTPRequest()
+        { reset(); }
+    void reset()
+        {
+        state_ = METHOD;
+        flags_ = 0;
+        method_ = OTHER;
+        route_ = NO_ROUTE;
+        length_ = 0;
+        start();
+        }
+
+    // Parse up to |len| bytes of the request, given the paths in
+    // |routes|. Stops at the start of the body, if there is one, and
+    // returns the number of bytes used.
+    uint16_t parse(const char *data, uint16_t len,
+                   const char *const *routes);
+    // True once the headers have been parsed and there are still
+    // bodyLeft() bytes of body to come.
+    bool inBody() const
+        { return state_ == BODY; }
+    uint16_t bodyLeft() const
+        { return length_; }
+    // |len| bytes of the body have been dealt with.
+    void consumed(uint16_t len)
+        {
+        length_ -= len;
+        if (length_ == 0)
+            state_ = DONE;
+        }
+    // True once the whole request, including its body, has been seen.
+    bool complete() const
+        { return state_ == DONE; }
+
+    byte method() const
+        { return method_; }
+    // The index of the path in the route table, or NO_ROUTE.
+    byte route() const
+        { return route_; }
+    bool http11() const
+        { return flags_ & HTTP11; }
+    // An HTTP/1.0 client gets the connection closed, since it can't
+    // be sent a chunked response.
+    bool keepAlive() const
+        { return (flags_ & (HTTP11 | CLOSE)) == HTTP11; }
+
+private:
+    enum State
+        {
+        METHOD,
+        PATH,
+        QUERY,
+        VERSION,
+        HEADER_NAME,
+        HEADER_VALUE,
+        BODY,
+        DONE,
+        };
+    enum Flags
+        {
+        HTTP11 = 1,
+        CLOSE = 2,
+        };
+    // The order of http_headers.
+    enum Header
+        {
+        CONNECTION,
+        CONTENT_LENGTH,
+        };
+
+    // Start matching a new token against a table.
+    void start()
+        {
+        pos_ = 0;
+        candidates_ = 0xffff;
+        }
+    // The request line has ended.
+    void headers()
+        {
+        state_ = HEADER_NAME;
+        start();
+        }
+    static char lower(char c)
+        { return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c; }
+    void next(char c, const char *const *table);
+    // The first string in |table| which matched all of the token, or
+    // NO_ROUTE.
+    byte matched(const char *const *table) const;
+
+    byte state_;
+    byte flags_;
+    byte method_;
+    byte route_;
+    byte header_;
+    // Where we are in the token being matched, and a bit for each
+    // string in its table it still matches.
+    byte pos_;
+    uint16_t candidates_;
+    // The Content-Length, then what is left of the body.
+    uint16_t length_;
+    };
+
+// Narrow the candidates to those with |c| at pos_.
+inline void HTTPRequest::next(char c, const char *const *table)
+    {
+    if (pos_ == 0xff || c == '\0')
+        {
+        candidates_ = 0;
+        return;
+        }
+    uint16_t bit = 1;
+    for (byte i = 0; bit != 0; ++i, bit <<= 1)
+        {
+        const char *s = (const char *)pgm_read_word(&table[i]);
+        if (s == 0)
+            break;
+        // A candidate has matched so far, so s is at least pos_ long.
+        if ((candidates_ & bit) && pgm_read_byte(s + pos_) != c)
+            candidates_ &= ~bit;
+        }
+    ++pos_;
+    }
+
+inline byte HTTPRequest::matched(const char *const *table) const
+    {
+    uint16_t bit = 1;
+    for (byte i = 0; bit != 0; ++i, bit <<= 1)
+        {
+        const char *s = (const char *)pgm_read_word(&table[i]);
+        if (s == 0)
+            break;
+        if ((candidates_ & bit) && pgm_read_byte(s + pos_) == '\0')
+            return i;
+        }
+    return NO_ROUTE;
+    }
+
+inline uint16_t HTTPRequest::parse(const char *data, uint16_t len,
+                                   const char *const *routes)
+    {
+    uint16_t n = 0;
+
+    while (n < len && state_ < BODY)
+        {
+        char c = data[n++];
+
+        // Lines end with "\r\n", but a bare '\n' will do.
+        if (c == '\r')
+            continue;
+        switch (state_)
+            {
+        case METHOD:
+            if (c == ' ')
+                {
+                method_ = matched(http_methods);
+                if (method_ == NO_ROUTE)
+                    method_ = OTHER;
+                state_ = PATH;
+                start();
+                }
+            else
+                next(c, http_methods);
+            break;
+
+        case PATH:
+            if (c == ' ' || c == '?' || c == '\n')
+                {
+                route_ = matched(routes);
+                state_ = c == '?' ? QUERY : VERSION;
+                start();
+                // An HTTP/0.9 request has no version.
+                if (c == '\n')
+                    headers();
+                }
+            else
+                next(c, routes);
+            break;
+
+        case QUERY:
+            if (c == ' ')
+                state_ = VERSION;
+            else if (c == '\n')
+                headers();
+            break;
+
+        case VERSION:
+            if (c == '\n')
+                {
+                if (matched(http_versions) == 1)
+                    flags_ |= HTTP11;
+                headers();
+                }
+            else
+                next(c, http_versions);
+            break;
+
+        case HEADER_NAME:
+            if (c == '\n')
+                {
+                // An empty line ends the headers.
+                if (pos_ == 0)
+                    state_ = length_ != 0 ? BODY : DONE;
+                start();
+                }
+            else if (c == ':')
+                {
+                header_ = matched(http_headers);
+                state_ = HEADER_VALUE;
+                start();
+                }
+            else
+                next(lower(c), http_headers);
+            break;
+
+        case HEADER_VALUE:
+            if (c == '\n')
+                {
+                if (header_ == CONNECTION
+                    && matched(http_connection_values) == 0)
+                    flags_ |= CLOSE;
+                state_ = HEADER_NAME;
+                start();
+                }
+            else if (header_ == CONTENT_LENGTH)
+                {
+                if (c >= '0' && c <= '9')
+                    length_ = length_ * 10 + c - '0';
+                }
+            // Skipping spaces before the value.
+            else if (header_ == CONNECTION && (c != ' ' || pos_ != 0))
+                next(lower(c), http_connection_values);
+            break;
+            }
+        }
+    return n;
+    }
+
+// Writes the part of a response from |offset| on into |data|, up to
+// |maxlen| bytes, given all of the response from its start.
+class HTTPWriter
+    {
+public:
+    HTTPWriter(byte *data, uint16_t maxlen, uint32_t offset)
+      : data_(data), maxlen_(maxlen), len_(0), skip_(offset)
+        {}
+
+    void put(char c)
+        {
+        if (skip_ != 0)
+            --skip_;
+        else if (len_ < maxlen_)
+            data_[len_++] = c;
+        }
+    void put(const byte *data, uint16_t length)
+        {
+        while (length--)
+            put(*data++);
+        }
+    void put_p(const char *pmem)
+        {
+        char c;
+
+        while ((c = pgm_read_byte(pmem++)))
+            put(c);
+        }
+    void put_hex(uint16_t n)
+        {
+        byte shift = 12;
+
+        while (shift != 0 && (n >> shift) == 0)
+            shift -= 4;
+        for ( ; ; shift -= 4)
+            {
+            put(hexdigit((n >> shift) & 0xf));
+            if (shift == 0)
+                break;
+            }
+        }
+
+    // Bytes still to be passed over before |offset|.
+    uint32_t skipping() const
+        { return skip_; }
+    // Pass over |n| of them without generating them.
+    void skip(uint32_t n)
+        { skip_ -= n; }
+    // Where the next byte goes, and how much room there is.
+    byte *end() const
+        { return data_ + len_; }
+    uint16_t room() const
+        { return maxlen_ - len_; }
+    void wrote(uint16_t n)
+        { len_ += n; }
+    uint16_t length() const
+        { return len_; }
+
+private:
+    byte *data_;
+    uint16_t maxlen_;
+    uint16_t len_;
+    uint32_t skip_;
+    };
+
+// An HTTP server on |TCP|, which is a TCPServer or TCPListener with
+// |Derived| as its Derived. |Derived| has a ROUTES table, as above,
+// and any of
+//
+//   // Part of the body of a POST. Called as it arrives.
+//   void requestBody(byte conn, const char *data, uint16_t len);
+//   // The request is complete and the response is about to start.
+//   void requestComplete(byte conn);
+//   // The Content-Type of the response, in PROGMEM.
+//   const char *contentType(byte conn);
+//   // Up to |maxlen| bytes of the body of the response, from |offset|
+//   // on. Returning less than |maxlen| ends it. Like TCPListener's
+//   // generate(), the same offset must always give the same data.
+//   uint16_t body(byte conn, uint32_t offset, byte *data,
+//                 uint16_t maxlen);
+//
+// which are only called for requests which matched a route. request()
+// says which. Anything else gets a 404, or a 501 if the method isn't
+// GET, HEAD or POST.
+template <class Derived, class TCP> class HTTPServer : public TCP
+    {
+public:
+    const HTTPRequest &request(byte conn) const
+        { return requests_[conn]; }
+
+    void requestBody(byte conn, const char *data, uint16_t len)
+        {}
+    void requestComplete(byte conn)
+        {}
+    const char *contentType(byte conn)
+        { return PSTR("text/plain"); }
+    uint16_t body(byte conn, uint32_t offset, byte *data, uint16_t maxlen)
+        { return 0; }
+
+    // For TCP.
+    void packetReceived();
+    uint16_t generate(byte conn, uint32_t offset, byte *data,
+                      uint16_t maxlen);
+    void connectionOpened(byte conn)
+        { requests_[conn].reset(); }
+
+    // Body bytes in each chunk of a chunked response.
+    static const byte CHUNK = 64;
+
+private:
+    Derived &derived()
+        { return *static_cast<Derived *>(this); }
+    bool found(byte conn) const
+        {
+        return requests_[conn].route() != HTTPRequest::NO_ROUTE
+          && requests_[conn].method() != HTTPRequest::OTHER;
+        }
+
+    HTTPRequest requests_[TCP::CONNECTIONS];
+    };
+
+template <class Derived, class TCP>
+  void HTTPServer<Derived, TCP>::packetReceived()
+    {
+    byte conn = this->connection();
+    HTTPRequest &r = requests_[conn];
+    const char *data = this->getData();
+    uint16_t len = this->getDataLength();
+
+    // The response to the last request on this connection has been
+    // sent, or this wouldn't have been called.
+    if (r.complete())
+        r.reset();
+
+    uint16_t n = r.parse(data, len, Derived::ROUTES);
+    if (r.inBody())
+        {
+        data += n;
+        len -= n;
+        if (len > r.bodyLeft())
+            len = r.bodyLeft();
+        if (len != 0)
+            {
+            if (found(conn))
+                derived().requestBody(conn, data, len);
+            r.consumed(len);
+            }
+        }
+    // Anything after the request is dropped.
+    if (r.complete())
+        {
+        if (found(conn))
+            derived().requestComplete(conn);
+        this->stream(!r.keepAlive());
+        }
+    }
+
+template <class Derived, class TCP>
+  uint16_t HTTPServer<Derived, TCP>::generate(byte conn, uint32_t offset,
+                                              byte *data, uint16_t maxlen)
+    {
+    const HTTPRequest &r = requests_[conn];
+    HTTPWriter w(data, maxlen, offset);
+    bool ok = found(conn);
+
+    // The status line and headers.
+    w.put_p(r.http11() ? PSTR("HTTP/1.1 ") : PSTR("HTTP/1.0 "));
+    if (ok)
+        w.put_p(PSTR("200 OK"));
+    else if (r.method() == HTTPRequest::OTHER)
+        w.put_p(PSTR("501 Not Implemented"));
+    else
+        w.put_p(PSTR("404 Not Found"));
+    w.put_p(PSTR("\r\nContent-Type: "));
+    w.put_p(ok ? derived().contentType(conn) : PSTR("text/plain"));
+    if (r.http11())
+        w.put_p(PSTR("\r\nTransfer-Encoding: chunked"));
+    if (!r.keepAlive())
+        w.put_p(PSTR("\r\nConnection: close"));
+    w.put_p(PSTR("\r\n\r\n"));
+
+    if (w.room() == 0 || r.method() == HTTPRequest::HEAD)
+        return w.length();
+
+    if (!r.http11())
+        {
+        // Just the body, and the connection is closed after it.
+        if (ok)
+            w.wrote(derived().body(conn, w.skipping(), w.end(), w.room()));
+        return w.length();
+        }
+
+    // Every chunk but the last has CHUNK bytes, so whole chunks before
+    // |offset| can be passed over, as long as the body didn't end in
+    // them.
+    byte hexlen = CHUNK > 0xf ? 2 : 1;
+    uint16_t whole = hexlen + 2 + CHUNK + 2;
+    uint32_t k = w.skipping() / whole;
+    byte last;
+    while (k != 0
+           && (!ok || derived().body(conn, k * CHUNK - 1, &last, 1) == 0))
+        --k;
+    w.skip(k * whole);
+
+    for ( ; w.room() != 0; ++k)
+        {
+        byte chunk[CHUNK];
+        uint16_t n = ok ? derived().body(conn, k * CHUNK, chunk, CHUNK) : 0;
+
+        if (n != 0)
+            {
+            w.put_hex(n);
+            w.put_p(PSTR("\r\n"));
+            w.put(chunk, n);
+            w.put_p(PSTR("\r\n"));
+            }
+        if (n < CHUNK)
+            {
+            w.put_p(PSTR("0\r\n\r\n"));
+            break;
+            }
+        }
+    return w.length();
+    }
+
+#endif
@@ -9,10 +9,15 @@
  *
  * IP, Arp, UDP and TCP functions.
  *
- * The TCP implementation uses some size optimisations which are valid
+ * The make_tcp_* functions use some size optimisations which are valid
  * only if all data can be sent in one single packet. This is however
  * not a big limitation for a microcontroller as you will anyhow use
- * small web-pages. The TCP stack is therefore a SDP-TCP stack (single data packet TCP).
+ * small web-pages. They are therefore a SDP-TCP stack (single data
+ * packet TCP). TCPServer (tcp_server.h) keeps per connection state
+ * and uses make_tcp_segment() to send larger responses.
+ *
+ * Packets we start ourselves can leave the destination MAC to the ARP
+ * cache, see send_routed().
  *
  * Chip type           : ATMEGA88 with ENC28J60
  *********************************************/
@@ -22,6 +27,7 @@
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include "net.h"
+#include "checksum.h"
 #include "enc28j60.h"
 
 
@@ -74,24 +80,55 @@ public:
             // =length given to this function - (IP.scr+IP.dst length)
             sum += len-8; // = real tcp len
             }
-        // build the sum of 16bit words
-        while (len > 1)
-            {
-            sum += 0xFFFF & (*buf << 8 | *(buf+1));
-            buf += 2;
-            len -= 2;
-            }
-        // if there is a byte left then add it (padded with zero)
-        if (len)
-            sum += (0xFF & *buf) << 8;
-        // now calculate the sum over the bytes in the sum
-        // until the result is only 16bit long
-        while (sum >> 16)
-            sum = (sum & 0xFFFF)+(sum >> 16);
+        // build the sum of 16bit words, a byte left over is padded
+        // with zero
+        sum = inet_sum(buf, len, sum);
         // build 1's complement:
         return (uint16_t) sum ^ 0xFFFF;
         }
 
+    // Correct the checksum at |ck| for a 16 bit word it covers
+    // changing from |old| to |now|, see RFC 1624.
+    static void checksum_adjust(uint8_t *ck, uint16_t old, uint16_t now)
+        {
+        uint16_t c = inet_update((ck[0] << 8) | ck[1], old, now);
+        ck[0] = c >> 8;
+        ck[1] = c & 0xff;
+        }
+
+    // A UDP checksum of 0 means there is none, so 0xffff is sent
+    // instead, which is the same in ones' complement. TCP doesn't
+    // mind either way.
+    static uint16_t udp_checksum(uint16_t ck)
+        { return ck == 0 ? 0xffff : ck; }
+
+    // Send the |len| byte frame in buf, filling in the UDP or TCP
+    // checksum at |ck_p|. The checksum covers ip.src to the end of
+    // the frame and the rest of the pseudo header, |pseudo| (the
+    // protocol plus the UDP/TCP length). It is summed by the DMA of
+    // the Ethernet chip once the frame is in its buffer, so the
+    // payload is only gone over once, by the SPI. A frame too long for
+    // the chip's transmit buffer is dropped.
+    static void send_checksummed(uint8_t *buf, uint16_t len, uint16_t ck_p,
+                                 uint16_t pseudo)
+        {
+        if (!Ethernet::TxFits(len))
+            return;
+        buf[ck_p]=0;
+        buf[ck_p+1]=0;
+        while (!Ethernet::TxBegin(len))
+            ;
+        Ethernet::WriteBuffer(len, buf);
+        InetChecksum sum(~Ethernet::TxChecksum(IP_SRC_P, len-IP_SRC_P));
+        sum.add16(pseudo);
+        uint16_t ck=udp_checksum(sum.result());
+        Ethernet::TxPatch(ck_p, ck);
+        Ethernet::TxEnd(len);
+        // leave buf as it was sent
+        buf[ck_p]=ck>>8;
+        buf[ck_p+1]=ck&0xff;
+        }
+
     // you must call this function once before you use any of the
     // other functions:
     static void init_ip_arp_udp_tcp(uint8_t *mymac, uint8_t *myip)
@@ -100,7 +137,43 @@ public:
             ipaddr_[i] = myip[i];
         for (byte i = 0; i < 6; ++i)
             macaddr_[i] = mymac[i];
+        set_filter();
         }
+    // Change our address, e.g. to one from DHCP. Until it is set to
+    // something other than 0.0.0.0, any IP packet sent to our MAC
+    // address is taken to be for us.
+    static void set_ip(const uint8_t *ip)
+        {
+        for (byte i = 0; i < 4; ++i)
+            ipaddr_[i] = ip[i];
+        set_filter();
+        }
+    // The chip passes unicast packets for our MAC and broadcast ARP.
+    // With |on|, only ARP requests for our IP get through, which saves
+    // waking up for the ARP chatter of a busy network, but hides
+    // gratuitous ARP from the ARP cache.
+    static void filter_arp(bool on)
+        {
+        filter_arp_ = on;
+        set_filter();
+        }
+    // Something listens for broadcasts other than ARP, e.g. a UDP
+    // service, so have the chip pass them all, and take IP packets to
+    // 255.255.255.255 or our subnet's broadcast address to be for us.
+    // Calls with |on| true and false must pair up. The chip passes
+    // broadcasts anyway while our IP is 0.0.0.0, for DHCP.
+    static void listen_broadcasts(bool on)
+        {
+        if (on)
+            ++broadcast_listeners_;
+        else
+            --broadcast_listeners_;
+        set_filter();
+        }
+    static const uint8_t *my_ip()
+        { return ipaddr_; }
+    static const uint8_t *my_mac()
+        { return macaddr_; }
 
     static uint8_t eth_type_is_arp_and_my_ip(uint8_t *buf, uint16_t len)
         {
@@ -115,7 +188,13 @@ public:
         return 1;
         }
 
+    // A fragment of a bigger datagram isn't accepted, see
+    // PacketReceiveForUs().
     static uint8_t eth_type_is_ip_and_my_ip(uint8_t *buf, uint16_t len)
+        {
+        return eth_type_is_ip_for_me(buf, len) && !is_fragment(buf);
+        }
+    static uint8_t eth_type_is_ip_for_me(uint8_t *buf, uint16_t len)
         {
         //eth+ip+udp header is 42
         if (len < 42)
@@ -126,11 +205,32 @@ public:
         if (buf[IP_HEADER_LEN_VER_P] != 0x45)
             // must be IP V4 and 20 byte header
             return 0;
+        if ((ipaddr_[0] | ipaddr_[1] | ipaddr_[2] | ipaddr_[3]) == 0)
+            return 1;
+        if (broadcast_listeners_ != 0 && is_broadcast(&buf[IP_DST_P]))
+            return 1;
         for (byte i = 0; i < 4; ++i)
             if (buf[IP_DST_P+i] !=  ipaddr_[i])
                 return 0;
         return 1;
         }
+    // |ip| is 255.255.255.255, or the broadcast address of our subnet.
+    static bool is_broadcast(const uint8_t *ip)
+        {
+        bool all = true, subnet = netmask_[0] != 0;
+        for (byte i = 0; i < 4; ++i)
+            {
+            all = all && ip[i] == 0xff;
+            subnet = subnet && (ip[i] | netmask_[i]) == 0xff
+              && ((ip[i] ^ ipaddr_[i]) & netmask_[i]) == 0;
+            }
+        return all || subnet;
+        }
+    static bool is_fragment(const uint8_t *buf)
+        {
+        return (buf[IP_FLAGS_H_P] & (IP_FLAGS_MF_V|IP_FRAGOFFSET_H_V))
+          || buf[IP_FLAGS_L_P];
+        }
 
     // make a return eth header from a received eth packet
     static void make_eth(uint8_t *buf)
@@ -143,13 +243,15 @@ public:
             }
         }
 
-    // make a new eth header for IP packet
-    static void make_eth_ip_new(uint8_t *buf, uint8_t* dst_mac)
+    // make a new eth header for IP packet. If dst_mac is 0 it is
+    // filled in by send_routed().
+    static void make_eth_ip_new(uint8_t *buf, const uint8_t* dst_mac)
         {
         //copy the destination mac from the source and fill my mac into src
         for (byte i = 0; i < 6; ++i)
             {
-            buf[ETH_DST_MAC +i]=dst_mac[i];
+            if (dst_mac)
+                buf[ETH_DST_MAC +i]=dst_mac[i];
             buf[ETH_SRC_MAC +i]=macaddr_[i];
             }
                 
@@ -173,9 +275,14 @@ public:
         }
 
     // make a new ip header for tcp packet
+    static void make_ip_tcp_new(uint8_t *buf, uint16_t len,
+                                const uint8_t *dst_ip)
+        { make_ip_new(buf, len, dst_ip, IP_PROTO_TCP_V); }
 
-    // make a return ip header from a received ip packet
-    static void make_ip_tcp_new(uint8_t *buf, uint16_t len,uint8_t *dst_ip)
+    // make a new ip header for a |proto| packet of |len| bytes from
+    // the ip header on
+    static void make_ip_new(uint8_t *buf, uint16_t len, const uint8_t *dst_ip,
+                            uint8_t proto)
         {
         // set ipv4 and header length
         buf[ IP_P ] = IP_V4_V | IP_HEADER_LENGTH_V;
@@ -200,7 +307,7 @@ public:
         buf[ IP_TTL_P ] = 128;
     
         // set ip packettype to tcp/udp/icmp...
-        buf[ IP_PROTO_P ] = IP_PROTO_TCP_V;
+        buf[ IP_PROTO_P ] = proto;
     
         // set source and destination ip address
         for (byte i = 0; i < 4; ++i)
@@ -232,17 +339,15 @@ public:
     // is used (should be use in synack) otherwise it is copied from
     // the packet we received
     static void make_tcphead(uint8_t *buf, uint16_t rel_ack_num, uint8_t mss,
-			     uint8_t cp_seq, byte port)
+			     uint8_t cp_seq, uint16_t port)
         {
         uint8_t tseq;
 
         for (byte i = 0; i < 2; ++i)
-            {
             buf[TCP_DST_PORT_H_P+i]=buf[TCP_SRC_PORT_H_P+i];
-            buf[TCP_SRC_PORT_H_P+i]=0; // clear source port
-            }
         // set source port  (http):
-        buf[TCP_SRC_PORT_L_P]=port;
+        buf[TCP_SRC_PORT_H_P]=port>>8;
+        buf[TCP_SRC_PORT_L_P]=port&0xff;
 
         // sequence numbers:
         // add the rel ack num to SEQACK
@@ -302,6 +407,114 @@ public:
             }
         }
 
+    // TCP sequence numbers, big endian in the packet.
+    static uint32_t get_u32(const uint8_t *p)
+        {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+          | ((uint16_t)p[2] << 8) | p[3];
+        }
+    static void put_u32(uint8_t *p, uint32_t v)
+        {
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+        }
+
+    // Build a TCP segment from scratch and send it. The |dlen| bytes
+    // of data must already be at TCP_DATA_P. If |mss| is non-zero it
+    // is sent as an option, which is only done on a SYN, so there
+    // must be no data. If |dst_mac| is 0 it is looked up in the ARP
+    // cache, see send_routed().
+    static void make_tcp_segment(uint8_t *buf, const uint8_t *dst_mac,
+                                 const uint8_t *dst_ip, uint16_t src_port,
+                                 uint16_t dst_port, uint32_t seq,
+                                 uint32_t ack, uint8_t flags,
+                                 uint16_t window, uint16_t mss,
+                                 uint16_t dlen)
+        {
+        uint16_t hlen = make_tcp_header(buf, dst_mac, dst_ip, src_port,
+                                        dst_port, seq, ack, flags, window,
+                                        mss, dlen);
+        if (dst_mac)
+            send_checksummed(buf, ETH_HEADER_LEN+IP_HEADER_LEN+hlen+dlen,
+                             TCP_CHECKSUM_H_P, IP_PROTO_TCP_V+hlen+dlen);
+        else
+            send_routed(buf, ETH_HEADER_LEN+IP_HEADER_LEN+hlen+dlen,
+                        TCP_CHECKSUM_H_P, IP_PROTO_TCP_V+hlen+dlen);
+        }
+    // Like make_tcp_segment(), but the |dlen| bytes of data are read
+    // from |source|, e.g. a ProgmemSource, as they are written to the
+    // Ethernet chip, and summed on the way. Only the headers are in
+    // buf, so the data can be longer than it. |dst_mac| must be
+    // known.
+    template <class Source>
+    static void make_tcp_segment_from(uint8_t *buf, const uint8_t *dst_mac,
+                                      const uint8_t *dst_ip,
+                                      uint16_t src_port, uint16_t dst_port,
+                                      uint32_t seq, uint32_t ack,
+                                      uint8_t flags, uint16_t window,
+                                      Source &source, uint16_t dlen)
+        {
+        make_tcp_header(buf, dst_mac, dst_ip, src_port, dst_port, seq, ack,
+                        flags, window, 0, dlen);
+        uint16_t len = TCP_DATA_P + dlen;
+
+        if (!Ethernet::TxFits(len))
+            return;
+        buf[TCP_CHECKSUM_H_P]=0;
+        buf[TCP_CHECKSUM_L_P]=0;
+        while (!Ethernet::TxBegin(len))
+            ;
+        Ethernet::WriteBuffer(TCP_DATA_P, buf);
+        // The headers are an even number of bytes from ip.src, so
+        // the data is summed the same way round.
+        InetChecksum sum(inet_sum(&buf[IP_SRC_P], TCP_DATA_P-IP_SRC_P, 0));
+        sum.add16(IP_PROTO_TCP_V+TCP_HEADER_LEN_PLAIN+dlen);
+        Ethernet::WriteFrom(dlen, source, sum);
+        uint16_t ck=sum.result();
+        Ethernet::TxPatch(TCP_CHECKSUM_H_P, ck);
+        Ethernet::TxEnd(len);
+        buf[TCP_CHECKSUM_H_P]=ck>>8;
+        buf[TCP_CHECKSUM_L_P]=ck&0xff;
+        }
+    // The headers for make_tcp_segment(), returning the TCP header
+    // length.
+    static uint16_t make_tcp_header(uint8_t *buf, const uint8_t *dst_mac,
+                                    const uint8_t *dst_ip, uint16_t src_port,
+                                    uint16_t dst_port, uint32_t seq,
+                                    uint32_t ack, uint8_t flags,
+                                    uint16_t window, uint16_t mss,
+                                    uint16_t dlen)
+        {
+        uint16_t hlen = TCP_HEADER_LEN_PLAIN;
+
+        make_eth_ip_new(buf, dst_mac);
+        if (mss)
+            {
+            buf[TCP_OPTIONS_P]=2;
+            buf[TCP_OPTIONS_P+1]=4;
+            buf[TCP_OPTIONS_P+2]=mss >> 8;
+            buf[TCP_OPTIONS_P+3]=mss & 0xff;
+            hlen += 4;
+            }
+        make_ip_tcp_new(buf, IP_HEADER_LEN+hlen+dlen, dst_ip);
+        buf[TCP_SRC_PORT_H_P]=src_port >> 8;
+        buf[TCP_SRC_PORT_L_P]=src_port & 0xff;
+        buf[TCP_DST_PORT_H_P]=dst_port >> 8;
+        buf[TCP_DST_PORT_L_P]=dst_port & 0xff;
+        put_u32(&buf[TCP_SEQ_H_P], seq);
+        put_u32(&buf[TCP_SEQACK_H_P], ack);
+        // header length in 32 bit words, in the upper 4 bits
+        buf[TCP_HEADER_LEN_P]=(hlen/4) << 4;
+        buf[TCP_FLAG_P]=flags;
+        buf[TCP_WINDOWSIZE_H_P]=window >> 8;
+        buf[TCP_WINDOWSIZE_L_P]=window & 0xff;
+        buf[TCP_URGENT_PTR_H_P]=0;
+        buf[TCP_URGENT_PTR_L_P]=0;
+        return hlen;
+        }
+
     static void make_arp_answer_from_request(uint8_t *buf)
         {
         make_eth(buf);
@@ -329,9 +542,8 @@ public:
         buf[ICMP_TYPE_P]=ICMP_TYPE_ECHOREPLY_V;
         // we changed only the icmp.type field from request(=8) to reply(=0).
         // we can therefore easily correct the checksum:
-        if (buf[ICMP_CHECKSUM_P] > (0xff-0x08))
-            buf[ICMP_CHECKSUM_P+1]++;
-        buf[ICMP_CHECKSUM_P]+=0x08;
+        checksum_adjust(&buf[ICMP_CHECKSUM_P], ICMP_TYPE_ECHOREQUEST_V << 8,
+                        ICMP_TYPE_ECHOREPLY_V << 8);
         
         Ethernet::PacketSend(len,buf);
         }
@@ -340,7 +552,6 @@ public:
     static void make_udp_reply_from_request(uint8_t *buf, char *data,
 					    uint8_t datalen, uint16_t dstport)
         {
-        uint16_t ck;
         make_eth(buf);
         if (datalen>220)
             datalen=220;
@@ -354,19 +565,15 @@ public:
         // calculte the udp length:
         buf[UDP_LEN_H_P]=0;
         buf[UDP_LEN_L_P]=UDP_HEADER_LEN+datalen;
-        // zero the checksum
-        buf[UDP_CHECKSUM_H_P]=0;
-        buf[UDP_CHECKSUM_L_P]=0;
         // copy the data:
         for (byte i = 0; i < datalen; ++i)
             buf[UDP_DATA_P+i]=data[i];
-        ck=checksum(&buf[IP_SRC_P], 16 + datalen,1);
-        buf[UDP_CHECKSUM_H_P]=ck>>8;
-        buf[UDP_CHECKSUM_L_P]=ck& 0xff;
-        Ethernet::PacketSend(UDP_HEADER_LEN+IP_HEADER_LEN+ETH_HEADER_LEN+datalen,buf);
+        send_checksummed(buf, UDP_HEADER_LEN+IP_HEADER_LEN+ETH_HEADER_LEN+datalen,
+                         UDP_CHECKSUM_H_P,
+                         IP_PROTO_UDP_V+UDP_HEADER_LEN+datalen);
         }
 
-    static void make_tcp_synack_from_syn(uint8_t *buf, byte port)
+    static void make_tcp_synack_from_syn(uint8_t *buf, uint16_t port)
         {
         uint16_t ck;
         make_eth(buf);
@@ -465,7 +672,7 @@ public:
 
     // Make just an ack packet with no tcp data inside
     // This will modify the eth/ip/tcp header 
-    static void make_tcp_ack_from_any(uint8_t *buf, byte port)
+    static void make_tcp_ack_from_any(uint8_t *buf, uint16_t port)
         {
         uint16_t j;
 
@@ -509,22 +716,20 @@ public:
     
         // total length field in the IP header must be set:
         // 20 bytes IP + 20 bytes tcp (when no options) + len of data
+        // Only the length differs from the ack just sent, so its
+        // header checksum is updated rather than summed again.
         j=IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen;
+        checksum_adjust(&buf[IP_CHECKSUM_P], IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN,
+                        j);
         buf[IP_TOTLEN_H_P]=j>>8;
         buf[IP_TOTLEN_L_P]=j& 0xff;
-        fill_ip_hdr_checksum(buf);
-        // zero the checksum
-        buf[TCP_CHECKSUM_H_P]=0;
-        buf[TCP_CHECKSUM_L_P]=0;
-        // calculate the checksum, len=8 (start from ip.src) + TCP_HEADER_LEN_PLAIN + data len
-        j=checksum(&buf[IP_SRC_P], 8+TCP_HEADER_LEN_PLAIN+dlen,2);
-        buf[TCP_CHECKSUM_H_P]=j>>8;
-        buf[TCP_CHECKSUM_L_P]=j& 0xff;
-        Ethernet::PacketSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen+ETH_HEADER_LEN,buf);
+        send_checksummed(buf, IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlen+ETH_HEADER_LEN,
+                         TCP_CHECKSUM_H_P,
+                         IP_PROTO_TCP_V+TCP_HEADER_LEN_PLAIN+dlen);
         }
 
     /* new functions for web client interface */
-    static void make_arp_request(uint8_t *buf, uint8_t *server_ip)
+    static void make_arp_request(uint8_t *buf, const uint8_t *server_ip)
         {
         for (byte i = 0; i < 6; ++i)
             {
@@ -589,16 +794,163 @@ public:
         return 1;
         }
 
-    // make a  tcp header
+    // The ARP cache. Entries are kept most recently used first, and
+    // when it is full the last one is replaced. An entry expires
+    // ARP_TIMEOUT calls of arp_tick() after the host was last heard
+    // from, and an unanswered request is repeated on each tick up to
+    // ARP_RETRIES times.
+    static const byte ARP_CACHE = 4;
+    static const byte ARP_TIMEOUT = 240;
+    static const byte ARP_RETRIES = 3;
+
+    // Fragments of datagrams being put back together are dropped
+    // REASM_TIMEOUT calls of tick() after the first one arrived. A
+    // datagram can be in up to REASM_FRAGMENTS fragments. If the
+    // Ethernet chip has no REASM_SLOTS all fragments are dropped.
+    static const byte REASM_TIMEOUT = 5;
+    static const byte REASM_FRAGMENTS = 4;
+
+    // Call about once a second, to age the ARP cache and give up on
+    // datagrams whose fragments haven't all arrived.
+    static void tick()
+        {
+        arp_tick();
+        for (byte i = 0; i < Ethernet::REASM_SLOTS; ++i)
+            if (reasm_[i].fragments != 0 && ++reasm_[i].age > REASM_TIMEOUT)
+                reasm_[i].fragments = 0;
+        }
+
+    // Packets for hosts outside our subnet are sent to |gateway|.
+    // Without one, all hosts are taken to be on the local network.
+    static void set_gateway(const uint8_t *gateway, const uint8_t *netmask)
+        {
+        for (byte i = 0; i < 4; ++i)
+            {
+            gateway_[i] = gateway[i];
+            netmask_[i] = netmask[i];
+            }
+        }
+
+    // The host on the local network a packet for |ip| goes to.
+    static const uint8_t *next_hop(const uint8_t *ip)
+        {
+        for (byte i = 0; i < 4; ++i)
+            if ((ip[i] ^ ipaddr_[i]) & netmask_[i])
+                return gateway_;
+        return ip;
+        }
+
+    // The MAC address of |ip|, which must be on the local network, or
+    // 0 if it isn't known yet. Then an ARP request is sent, unless
+    // one already is outstanding, and the answer is picked up by
+    // PacketReceiveForUs().
+    static const uint8_t *arp_resolve(const uint8_t *ip)
+        {
+        ArpEntry *e = arp_entry(ip);
+        return e->state == ARP_RESOLVED ? e->mac : 0;
+        }
+
+    // Update the cache from an ARP packet. One from a host already in
+    // the cache, such as a gratuitous ARP, refreshes its entry, and a
+    // request for or reply to us adds one. A packet parked for the
+    // host (see send_routed()) is sent.
+    static void arp_learn(const uint8_t *buf, uint16_t len)
+        {
+        if (len < 42 || buf[ETH_TYPE_H_P] != ETHTYPE_ARP_H_V
+            || buf[ETH_TYPE_L_P] != ETHTYPE_ARP_L_V)
+            return;
+        const uint8_t *ip = &buf[ETH_ARP_SRC_IP_P];
+        // probes for duplicate addresses come from 0.0.0.0
+        if ((ip[0] | ip[1] | ip[2] | ip[3]) == 0)
+            return;
+        ArpEntry *e = arp_find(ip);
+        if (e == 0)
+            {
+            for (byte i = 0; i < 4; ++i)
+                if (buf[ETH_ARP_DST_IP_P+i] != ipaddr_[i])
+                    return;
+            e = arp_insert(ip);
+            }
+        arp_set(e, &buf[ETH_ARP_SRC_MAC_P]);
+        }
+
+    // Call about once a second to age the cache.
+    static void arp_tick()
+        {
+        for (byte i = 0; i < ARP_CACHE; ++i)
+            {
+            ArpEntry &e = arp_[i];
+            if (e.state == ARP_FREE)
+                continue;
+            ++e.age;
+            if (e.state == ARP_PENDING)
+                {
+                if (e.age > ARP_RETRIES)
+                    arp_drop(e);
+                else
+                    arp_request(e.ip);
+                }
+            else if (e.age >= ARP_TIMEOUT)
+                arp_drop(e);
+            }
+        }
+
+    // Like send_checksummed(), but the Ethernet destination is filled
+    // in from the ARP cache, for the next hop to the IP destination.
+    // If it isn't known yet the frame is parked in the Ethernet chip
+    // and sent once the ARP reply comes in, and false is returned.
+    // There is one parked frame per next hop, so a second one replaces
+    // the first. The frame is dropped, and the first one with it, if
+    // there is no room to park it: when Ethernet has no PARK_SLOTS,
+    // all of them hold frames for other hosts, or it is longer than
+    // Ethernet::PARK_FRAMELEN (768 bytes unless configured otherwise).
+    // The ARP request goes out all the same, so a caller which gets
+    // false for such a frame has to send it again once the next hop
+    // has answered. A frame for 255.255.255.255 is broadcast.
+    static bool send_routed(uint8_t *buf, uint16_t len, uint16_t ck_p,
+                            uint16_t pseudo)
+        {
+        if ((buf[IP_DST_P] & buf[IP_DST_P+1] & buf[IP_DST_P+2]
+             & buf[IP_DST_P+3]) == 0xff)
+            {
+            for (byte i = 0; i < 6; ++i)
+                buf[ETH_DST_MAC+i] = 0xff;
+            send_checksummed(buf, len, ck_p, pseudo);
+            return true;
+            }
+        ArpEntry *e = arp_entry(next_hop(&buf[IP_DST_P]));
+        if (e->state == ARP_RESOLVED)
+            {
+            for (byte i = 0; i < 6; ++i)
+                buf[ETH_DST_MAC+i] = e->mac[i];
+            send_checksummed(buf, len, ck_p, pseudo);
+            return true;
+            }
+        // The chip can't sum a parked frame, this is the slow path
+        // anyway.
+        buf[ck_p]=0;
+        buf[ck_p+1]=0;
+        uint16_t ck=udp_checksum(~inet_sum(&buf[IP_SRC_P], len-IP_SRC_P,
+                                           pseudo));
+        buf[ck_p]=ck>>8;
+        buf[ck_p+1]=ck&0xff;
+        if (!e->parked)
+            e->parked = arp_free_slot();
+        if (e->parked && !Ethernet::Park(e->parked - 1, len, buf))
+            e->parked = 0;
+        return false;
+        }
+
+    // make a  tcp header. If dest_mac is 0 it is looked up in the ARP
+    // cache, see send_routed().
     static void tcp_client_send_packet(uint8_t *buf, uint16_t dest_port,
 				       uint16_t src_port, uint8_t flags,
 				       uint8_t max_segment_size, 
 				       uint8_t clear_seqack,
 				       uint16_t next_ack_num, uint16_t dlength,
-				       uint8_t *dest_mac, uint8_t *dest_ip)
+				       const uint8_t *dest_mac, uint8_t *dest_ip)
         {
         uint8_t tseq;
-        uint16_t ck;
     
         make_eth_ip_new(buf, dest_mac);
 
@@ -679,12 +1031,15 @@ public:
         buf[ TCP_URGENT_PTR_H_P ] = 0;
         buf[ TCP_URGENT_PTR_L_P ] = 0;
     
-        // check sum
-        ck=checksum(&buf[IP_SRC_P], 8+TCP_HEADER_LEN_PLAIN+dlength,2);
-        buf[TCP_CHECKSUM_H_P]=ck>>8;
-        buf[TCP_CHECKSUM_L_P]=ck& 0xff;
-        // add 4 for option mss:
-        Ethernet::PacketSend(IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlength+ETH_HEADER_LEN,buf);
+        // check sum, dlength includes the 4 for option mss:
+        if (dest_mac)
+            send_checksummed(buf, IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlength+ETH_HEADER_LEN,
+                             TCP_CHECKSUM_H_P,
+                             IP_PROTO_TCP_V+TCP_HEADER_LEN_PLAIN+dlength);
+        else
+            send_routed(buf, IP_HEADER_LEN+TCP_HEADER_LEN_PLAIN+dlength+ETH_HEADER_LEN,
+                        TCP_CHECKSUM_H_P,
+                        IP_PROTO_TCP_V+TCP_HEADER_LEN_PLAIN+dlength);
         }
 
     static uint16_t tcp_get_dlength ( uint8_t *buf )
@@ -703,13 +1058,337 @@ public:
 
     static uint16_t PacketReceive(uint16_t size, byte *buf)
         { return Ethernet::PacketReceive(size, buf); }
+
+    // See ENC28J60::pollNeeded().
+    static bool pollNeeded()
+        { return Ethernet::pollNeeded(); }
+
+    // Like PacketReceive(), but only the headers are read at first,
+    // and packets which are neither ARP nor IP for our address are
+    // dropped without copying the rest of them out of the chip. The
+    // ARP cache learns from all ARP packets seen, and is refreshed by
+    // IP packets from hosts in it.
+    static uint16_t PacketReceiveForUs(uint16_t size, byte *buf)
+        {
+        uint16_t len = receive_for_us(size, buf);
+        // Frames parked for hosts which have just been heard from go
+        // now that the received packet is let go of.
+        arp_unpark();
+        return len;
+        }
+
+    // Read |len| bytes, from |offset| on, of the last datagram
+    // PacketReceiveForUs() put together from fragments, which may be
+    // longer than the buffer it was given. It stays in the Ethernet
+    // chip until the next fragment arrives.
+    static void reassembled_read(uint16_t offset, uint16_t len,
+                                 uint8_t *data)
+        {
+        Ethernet::ReassemblyRead(reasm_last_, offset, len, data);
+        }
 private:
+    struct ArpEntry
+        {
+        uint8_t ip[4];
+        uint8_t mac[6];
+        byte state;
+        byte age;
+        // 1 + the slot a frame waiting for this entry is parked in,
+        // or 0
+        byte parked;
+        };
+    enum { ARP_FREE, ARP_PENDING, ARP_RESOLVED };
+
+    // A datagram being put back together in the slot of the same
+    // index in the Ethernet chip. The Ethernet and IP headers are
+    // those of the first fragment, and the data follows them at its
+    // offset.
+    struct Reassembly
+        {
+        uint8_t src[4];
+        uint8_t id[2];
+        byte proto;
+        byte age;
+        // How many fragments have arrived, 0 if the slot is free, and
+        // where their data starts and how long it is, to spot repeats
+        // and overlaps.
+        byte fragments;
+        uint16_t offset[REASM_FRAGMENTS];
+        uint16_t length[REASM_FRAGMENTS];
+        // The data received so far, and the length of all of it once
+        // the last fragment is in, else 0.
+        uint16_t have;
+        uint16_t total;
+        };
+
+    static uint16_t receive_for_us(uint16_t size, byte *buf)
+        {
+        //eth+ip+udp header is 42
+        const uint16_t hdrlen = ETH_HEADER_LEN+IP_HEADER_LEN+UDP_HEADER_LEN;
+        uint16_t len = Ethernet::PacketBegin(hdrlen, buf);
+
+        if (len == 0)
+            return 0;
+        arp_learn(buf, len);
+        if (eth_type_is_ip_for_me(buf, len))
+            {
+            arp_seen(&buf[IP_SRC_P], &buf[ETH_SRC_MAC]);
+            if (is_fragment(buf))
+                return reassemble(size, buf, len);
+            }
+        else if (!eth_type_is_arp_and_my_ip(buf, len))
+            {
+            Ethernet::PacketEnd();
+            return 0;
+            }
+        if (len > size - 1)
+            len = size - 1;
+        if (len > hdrlen)
+            Ethernet::PacketRead(len - hdrlen, buf + hdrlen);
+        buf[len] = '\0';
+        Ethernet::PacketEnd();
+        return len;
+        }
+
+    // The fragment in |buf| belongs to a datagram in this slot.
+    static bool reasm_match(const Reassembly &r, const uint8_t *buf)
+        {
+        return r.fragments != 0 && r.proto == buf[IP_PROTO_P]
+          && r.id[0] == buf[IP_ID_H_P] && r.id[1] == buf[IP_ID_L_P]
+          && r.src[0] == buf[IP_SRC_P] && r.src[1] == buf[IP_SRC_P+1]
+          && r.src[2] == buf[IP_SRC_P+2] && r.src[3] == buf[IP_SRC_P+3];
+        }
+    // Add the fragment of |len| bytes, whose headers are in |buf|, to
+    // its datagram. If that completes it, reads as much of it as fits
+    // into |buf| and returns that length, like PacketReceiveForUs(),
+    // else returns 0.
+    static uint16_t reassemble(uint16_t size, uint8_t *buf, uint16_t len)
+        {
+        const uint16_t hdrlen = ETH_HEADER_LEN + IP_HEADER_LEN;
+        uint16_t totlen = (buf[IP_TOTLEN_H_P] << 8) | buf[IP_TOTLEN_L_P];
+        if (totlen < IP_HEADER_LEN || totlen > len - ETH_HEADER_LEN)
+            {
+            Ethernet::PacketEnd();
+            return 0;
+            }
+        uint16_t dlen = totlen - IP_HEADER_LEN;
+        uint16_t frag = ((buf[IP_FLAGS_H_P] & IP_FRAGOFFSET_H_V) << 8)
+          | buf[IP_FLAGS_L_P];
+        uint16_t at = frag * 8;
+        bool more = buf[IP_FLAGS_H_P] & IP_FLAGS_MF_V;
+        byte i;
+
+        for (i = 0; i < Ethernet::REASM_SLOTS; ++i)
+            if (reasm_match(reasm_[i], buf))
+                break;
+        if (i == Ethernet::REASM_SLOTS)
+            {
+            // A new datagram, if there is a free slot.
+            for (i = 0; i < Ethernet::REASM_SLOTS; ++i)
+                if (reasm_[i].fragments == 0)
+                    break;
+            if (i == Ethernet::REASM_SLOTS)
+                {
+                Ethernet::PacketEnd();
+                return 0;
+                }
+            Reassembly &r = reasm_[i];
+            for (byte j = 0; j < 4; ++j)
+                r.src[j] = buf[IP_SRC_P+j];
+            r.id[0] = buf[IP_ID_H_P];
+            r.id[1] = buf[IP_ID_L_P];
+            r.proto = buf[IP_PROTO_P];
+            r.age = 0;
+            r.have = 0;
+            r.total = 0;
+            }
+        Reassembly &r = reasm_[i];
+
+        uint16_t end = at + dlen;
+        bool bad = false;
+        for (byte j = 0; j < r.fragments; ++j)
+            {
+            uint16_t jend = r.offset[j] + r.length[j];
+            if (r.offset[j] == at && r.length[j] == dlen)
+                {
+                // a repeat
+                Ethernet::PacketEnd();
+                return 0;
+                }
+            // Overlapping fragments, or data beyond the last one, would
+            // leave |have| counting bytes twice, and a hole in the
+            // datagram when it looks complete.
+            if ((at < jend && r.offset[j] < end) || (!more && jend > end))
+                bad = true;
+            }
+        // All but the last fragment are a multiple of 8 bytes long.
+        if (bad || dlen == 0 || (more && (dlen & 7))
+            || (r.total != 0 && end > r.total)
+            || (uint32_t)hdrlen + at + dlen > Ethernet::REASM_LEN
+            || r.fragments == REASM_FRAGMENTS)
+            {
+            // It can't be put together, forget it.
+            r.fragments = 0;
+            Ethernet::PacketEnd();
+            return 0;
+            }
+        r.offset[r.fragments] = at;
+        r.length[r.fragments++] = dlen;
+        if (at == 0)
+            Ethernet::PacketCopy(0, hdrlen + dlen, i, 0);
+        else
+            Ethernet::PacketCopy(hdrlen, dlen, i, hdrlen + at);
+        Ethernet::PacketEnd();
+        r.have += dlen;
+        if (!more)
+            r.total = end;
+        if (r.have != r.total)
+            return 0;
+
+        // Complete, and it looks as if it came in one piece.
+        r.fragments = 0;
+        reasm_last_ = i;
+        len = hdrlen + r.total;
+        if (len > size - 1)
+            len = size - 1;
+        Ethernet::ReassemblyRead(i, 0, len, buf);
+        buf[len] = '\0';
+        // The header is the first fragment's, with the length and
+        // flags of the whole datagram, and its checksum to match.
+        totlen = (buf[IP_TOTLEN_H_P] << 8) | buf[IP_TOTLEN_L_P];
+        dlen = IP_HEADER_LEN + r.total;
+        buf[IP_TOTLEN_H_P] = dlen >> 8;
+        buf[IP_TOTLEN_L_P] = dlen & 0xff;
+        checksum_adjust(&buf[IP_CHECKSUM_P], totlen, dlen);
+        uint16_t flags = (buf[IP_FLAGS_H_P] << 8) | buf[IP_FLAGS_L_P];
+        buf[IP_FLAGS_H_P] &= ~(IP_FLAGS_MF_V|IP_FRAGOFFSET_H_V);
+        buf[IP_FLAGS_L_P] = 0;
+        checksum_adjust(&buf[IP_CHECKSUM_P], flags, buf[IP_FLAGS_H_P] << 8);
+        return len;
+        }
+
+    // Moves the entry for |ip| to the front, returns 0 if there is none.
+    static ArpEntry *arp_find(const uint8_t *ip)
+        {
+        for (byte i = 0; i < ARP_CACHE; ++i)
+            if (arp_[i].state != ARP_FREE
+                && arp_[i].ip[0] == ip[0] && arp_[i].ip[1] == ip[1]
+                && arp_[i].ip[2] == ip[2] && arp_[i].ip[3] == ip[3])
+                return arp_front(i);
+        return 0;
+        }
+    static ArpEntry *arp_front(byte i)
+        {
+        ArpEntry e = arp_[i];
+        for ( ; i > 0; --i)
+            arp_[i] = arp_[i-1];
+        arp_[0] = e;
+        return &arp_[0];
+        }
+    // A new pending entry for |ip| at the front, in place of a free
+    // one or else the least recently used.
+    static ArpEntry *arp_insert(const uint8_t *ip)
+        {
+        byte i = 0;
+        while (i < ARP_CACHE - 1 && arp_[i].state != ARP_FREE)
+            ++i;
+        arp_drop(arp_[i]);
+        ArpEntry *e = arp_front(i);
+        for (byte j = 0; j < 4; ++j)
+            e->ip[j] = ip[j];
+        e->state = ARP_PENDING;
+        e->age = 0;
+        return e;
+        }
+    // The entry for |ip|, starting to resolve it if there is none.
+    static ArpEntry *arp_entry(const uint8_t *ip)
+        {
+        ArpEntry *e = arp_find(ip);
+        if (e == 0)
+            {
+            e = arp_insert(ip);
+            arp_request(ip);
+            }
+        return e;
+        }
+    // A frame parked for the entry is sent by arp_unpark(), as this
+    // is called while the received packet is still open in the chip.
+    static void arp_set(ArpEntry *e, const uint8_t *mac)
+        {
+        for (byte i = 0; i < 6; ++i)
+            e->mac[i] = mac[i];
+        e->state = ARP_RESOLVED;
+        e->age = 0;
+        }
+    static void arp_unpark()
+        {
+        for (byte i = 0; i < ARP_CACHE; ++i)
+            if (arp_[i].state == ARP_RESOLVED && arp_[i].parked)
+                {
+                Ethernet::Unpark(arp_[i].parked - 1, arp_[i].mac);
+                arp_[i].parked = 0;
+                }
+        }
+    // An IP packet came from |ip| at |mac|.
+    static void arp_seen(const uint8_t *ip, const uint8_t *mac)
+        {
+        if (next_hop(ip) != ip)
+            return;
+        ArpEntry *e = arp_find(ip);
+        if (e != 0)
+            arp_set(e, mac);
+        }
+    static void arp_drop(ArpEntry &e)
+        {
+        if (e.parked)
+            Ethernet::Discard(e.parked - 1);
+        e.state = ARP_FREE;
+        e.parked = 0;
+        }
+    // 1 + a parking slot not used by any entry, or 0 if there is
+    // none.
+    static byte arp_free_slot()
+        {
+        for (byte s = 1; s <= Ethernet::PARK_SLOTS; ++s)
+            {
+            byte i = 0;
+            while (i < ARP_CACHE && arp_[i].parked != s)
+                ++i;
+            if (i == ARP_CACHE)
+                return s;
+            }
+        return 0;
+        }
+    static void set_filter()
+        {
+        if (broadcast_listeners_ != 0
+            || (ipaddr_[0] | ipaddr_[1] | ipaddr_[2] | ipaddr_[3]) == 0)
+            Ethernet::FilterUnicastAndBroadcast();
+        else if (filter_arp_)
+            Ethernet::FilterUnicastAndArp(ipaddr_);
+        else
+            Ethernet::FilterUnicastAndArpBroadcasts();
+        }
+    static void arp_request(const uint8_t *ip)
+        {
+        // eth+arp is 42 bytes
+        uint8_t buf[42];
+        make_arp_request(buf, ip);
+        }
+
+    static ArpEntry arp_[ARP_CACHE];
+    static Reassembly reasm_[Ethernet::REASM_SLOTS];
+    static byte reasm_last_;
+    static uint8_t gateway_[4];
+    static uint8_t netmask_[4];
     static uint16_t ip_identifier_;
     static uint8_t ipaddr_[4];
     static uint8_t macaddr_[6];
     static int16_t info_hdr_len_;
     static int16_t info_data_len_;
     static uint8_t seqnum_;
+    static bool filter_arp_;
+    static byte broadcast_listeners_;
     };
 
 template <class Ethernet>
@@ -719,5 +1398,14 @@ template <class Ethernet> uint8_t IP<Ethernet>::macaddr_[6];
 template <class Ethernet> int16_t IP<Ethernet>::info_hdr_len_;
 template <class Ethernet> int16_t IP<Ethernet>::info_data_len_;
 template <class Ethernet> uint8_t IP<Ethernet>::seqnum_ = 0xa;
+template <class Ethernet> bool IP<Ethernet>::filter_arp_;
+template <class Ethernet> byte IP<Ethernet>::broadcast_listeners_;
+template <class Ethernet>
+  typename IP<Ethernet>::ArpEntry IP<Ethernet>::arp_[ARP_CACHE];
+template <class Ethernet> uint8_t IP<Ethernet>::gateway_[4];
+template <class Ethernet> typename IP<Ethernet>::Reassembly
+  IP<Ethernet>::reasm_[Ethernet::REASM_SLOTS];
+template <class Ethernet> byte IP<Ethernet>::reasm_last_;
+template <class Ethernet> uint8_t IP<Ethernet>::netmask_[4];
 
 /* end of ip_arp_udp.c */
@@ -40,6 +40,8 @@ void MySlaveObserver::canSend()
         buf[n*10 + 9] = buttons[n].Temperature() >> 8;
         }
     Slave::sendPacket(0, n * 10, buf);
+    // Rather than polling until it has gone.
+    RF12Star::sendWait();
     getReadings_ = false;
     }
 
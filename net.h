@@ -25,6 +25,7 @@
 // ******* ETH *******
 #define ETH_HEADER_LEN	14
 // values of certain bytes:
+#define ETHTYPE_ARP_V	0x0806
 #define ETHTYPE_ARP_H_V 0x08
 #define ETHTYPE_ARP_L_V 0x06
 #define ETHTYPE_IP_V	0x0800
@@ -101,6 +102,9 @@
 #define IP_FLAGS_P 			0x14     
 #define IP_FLAGS_H_P		0x14
 #define IP_FLAGS_L_P		0x15
+// More fragments, and the high bits of the fragment offset.
+#define IP_FLAGS_MF_V		0x20
+#define IP_FRAGOFFSET_H_V	0x1f
 #define IP_TTL_P			0x16
 #define IP_PROTO_P			0x17
 #define IP_CHECKSUM_P 		0x18 
@@ -0,0 +1,203 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+
+#ifndef NET_STACK_H
+#define NET_STACK_H
+
+#include "frame_pool.h"
+
+// One Ethernet poll loop shared by any number of protocol handlers,
+// e.g.
+//
+//   typedef NetList<ARPResponder<MyIP>,
+//           NetList<ICMPEcho<MyIP>,
+//           NetList<MyUDPListener,
+//           NetList<MyTCPServer> > > > Handlers;
+//   NetStack<MyIP, Handlers> net;
+//
+//   for ( ; ; )
+//       net.poll();
+//
+// Each handler says at compile time which packets it takes:
+//
+//   static const uint16_t ETHERTYPE;  // ETHTYPE_ARP_V or ETHTYPE_IP_V
+//   static const byte PROTOCOL;       // for IP, e.g. IP_PROTO_TCP_V, else 0
+//   static const uint16_t PORT;       // for UDP and TCP, 0 for any
+//
+// and has
+//
+//   void attach(byte *buf, uint16_t size); // the frame buffer
+//   void receive(uint16_t len);            // a packet it takes is in buf
+//   void idle();                           // on every poll()
+//
+// NetHandler provides attach() and idle(). The frame buffer is
+// borrowed from FramePool (see frame_pool.h) for the length of each
+// poll(), and given to the handlers with attach(), so they may only
+// use it in receive() and idle(), and can't keep anything in it. The type, protocol and
+// port of a packet are read once, and compared with the constants of
+// each handler in turn, which inline to the same code as a hand
+// written switch. The first handler that matches gets the packet.
+// Nothing is virtual.
+
+// The end of a NetList.
+class NetNil {};
+
+// A list of handler types.
+template <class Head, class Tail = NetNil> class NetList {};
+
+// A base for handlers.
+class NetHandler
+    {
+public:
+    NetHandler()
+      : buf_(0), size_(0)
+        {}
+    void attach(byte *buf, uint16_t size)
+        {
+        buf_ = buf;
+        size_ = size;
+        }
+    void idle()
+        {}
+    static const byte PROTOCOL = 0;
+    static const uint16_t PORT = 0;
+
+protected:
+    byte *buf_;
+    uint16_t size_;
+    };
+
+// Answers ARP requests for our address.
+template <class MyIP> class ARPResponder : public NetHandler
+    {
+public:
+    static const uint16_t ETHERTYPE = ETHTYPE_ARP_V;
+
+    void receive(uint16_t len)
+        { answer(buf_, len); }
+    static void answer(byte *buf, uint16_t len)
+        {
+        // replies to our own requests have already been seen by
+        // PacketReceiveForUs()
+        if (MyIP::eth_type_is_arp_and_my_ip(buf, len)
+            && buf[ARP_OPCODE_L_P] == ARP_OPCODE_REQUEST_L_V)
+            MyIP::make_arp_answer_from_request(buf);
+        }
+    };
+
+// Answers pings.
+template <class MyIP> class ICMPEcho : public NetHandler
+    {
+public:
+    static const uint16_t ETHERTYPE = ETHTYPE_IP_V;
+    static const byte PROTOCOL = IP_PROTO_ICMP_V;
+
+    void receive(uint16_t len)
+        { answer(buf_, len); }
+    static void answer(byte *buf, uint16_t len)
+        {
+        if (buf[ICMP_TYPE_P] == ICMP_TYPE_ECHOREQUEST_V)
+            MyIP::make_echo_reply_from_request(buf, len);
+        }
+    };
+
+// The handlers of a NetList, each with the ones after it.
+template <class List> class NetHandlers;
+
+template <> class NetHandlers<NetNil>
+    {
+public:
+    void attach(byte *, uint16_t)
+        {}
+    bool dispatch(uint16_t, byte, uint16_t, uint16_t)
+        { return false; }
+    void idle()
+        {}
+    };
+
+template <class Head, class Tail> class NetHandlers<NetList<Head, Tail> >
+    {
+public:
+    void attach(byte *buf, uint16_t size)
+        {
+        head_.attach(buf, size);
+        tail_.attach(buf, size);
+        }
+    bool dispatch(uint16_t type, byte proto, uint16_t port, uint16_t len)
+        {
+        if (Head::ETHERTYPE == type && Head::PROTOCOL == proto
+            && (Head::PORT == 0 || Head::PORT == port))
+            {
+            head_.receive(len);
+            return true;
+            }
+        return tail_.dispatch(type, proto, port, len);
+        }
+    void idle()
+        {
+        head_.idle();
+        tail_.idle();
+        }
+    Head &get(Head *)
+        { return head_; }
+    template <class H> H &get(H *h)
+        { return tail_.get(h); }
+
+private:
+    Head head_;
+    NetHandlers<Tail> tail_;
+    };
+
+// |Handlers| is a NetList.
+template <class MyIP, class Handlers> class NetStack
+    {
+public:
+    // The handler of type |H|.
+    template <class H> H &get()
+        { return handlers_.get((H *)0); }
+
+    // Receives a packet, if there is one, and passes it to the first
+    // handler which takes it. Then every handler gets an idle() call.
+    // Does nothing if FramePool has no frame free.
+    void poll();
+    // False if poll() would have nothing to do, so we can sleep. This
+    // doesn't know about timeouts in the handlers.
+    bool pollNeeded() const
+        { return MyIP::pollNeeded(); }
+
+private:
+    NetHandlers<Handlers> handlers_;
+    };
+
+template <class MyIP, class Handlers> void NetStack<MyIP, Handlers>::poll()
+    {
+    byte *buf = FramePool::borrow();
+
+    if (buf == 0)
+        return;
+    handlers_.attach(buf, FramePool::FRAME_SIZE);
+
+    // Anything not for us is dropped before it is copied into buf.
+    uint16_t plen = MyIP::PacketReceiveForUs(FramePool::FRAME_SIZE, buf);
+
+    if (plen != 0)
+        {
+        uint16_t type = (buf[ETH_TYPE_H_P] << 8) | buf[ETH_TYPE_L_P];
+        byte proto = 0;
+        uint16_t port = 0;
+
+        if (type == ETHTYPE_IP_V)
+            {
+            proto = buf[IP_PROTO_P];
+            // UDP and TCP have the destination port in the same place.
+            if (proto == IP_PROTO_TCP_V || proto == IP_PROTO_UDP_V)
+                port = (buf[TCP_DST_PORT_H_P] << 8) | buf[TCP_DST_PORT_L_P];
+            }
+        handlers_.dispatch(type, proto, port, plen);
+        }
+    handlers_.idle();
+
+    handlers_.attach(0, 0);
+    FramePool::giveBack(buf);
+    }
+
+#endif
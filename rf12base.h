@@ -28,10 +28,12 @@
 #include <stdint.h>
 #include <string.h>
 
-#include <util/crc16.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
 
 #include "arduino--.h"
 #include "clock16.h"
+#include "crc16.h"
 #include "spi.h"
 
 #define RF12_MAXDATA    66
@@ -42,15 +44,37 @@
 #define RF12_EEPROM_EKEY (RF12_EEPROM_ADDR + RF12_EEPROM_SIZE)
 #define RF12_EEPROM_ELEN 16
 
-// options for RF12_sleep()
+// option for _RF12Base::sleep()
 #define RF12_SLEEP 0
-#define RF12_WAKEUP -1
 
 //#define OPTIMIZE_SPI 1   // uncomment this to write to the RFM12B @ 8 Mhz
 
 // maximum transmit / receive buffer: 3 header + data + 2 crc bytes
 #define RF_MAX   (RF12_MAXDATA + 5)
 
+// Received frames are kept in a ring of RF12_RX_FRAMES buffers, so
+// the radio can go on receiving while the application deals with
+// one. Each takes RF_MAX bytes of RAM. Define it before including
+// this to change it, to at most 8.
+#ifndef RF12_RX_FRAMES
+# define RF12_RX_FRAMES 2
+#endif
+
+// The most of the channel's time this node takes, in percent, see
+// _RF12Base::canSend(). Regulations may say less, e.g. 1% in much of
+// the 868 MHz band in Europe.
+#ifndef RF12_AIRTIME_SHARE
+# define RF12_AIRTIME_SHARE 10
+#endif
+
+// The CRC is worked out a byte at a time in the interrupt handler,
+// by one of the engines in crc16.h. CRC16Table takes the least time
+// away from the application, for 512 bytes of flash. Define it
+// before including this to change it.
+#ifndef RF12_CRC
+# define RF12_CRC CRC16Bitwise
+#endif
+
 // pins used for the RFM12B interface - yes, there *is* logic in this madness:
 //
 //  - leave RFM_IRQ set to the pin which corresponds with INT0, because the
@@ -130,13 +154,111 @@
 #define NODE_ACKANY     0x20        // ack on broadcast packets if set
 #define NODE_ID         0x1F        // id of this node, as A..Z or 1..31
 
-template <class RFM_IRQ, class SelectPin> class _RF12Base
+// See http://blog.strobotics.com.au/2009/07/27/rfm12-tutorial-part-3a/
+// Transmissions are packetized, don't assume you can sustain these speeds! 
+//
+// Note - data rates are approximate. For higher data rates you may need to
+// alter receiver radio bandwidth and transmitter modulator bandwidth.
+// Note that bit 7 is a prescaler - don't just interpolate rates between
+// RF12_DATA_RATE_3 and RF12_DATA_RATE_2.
+enum rf12DataRates {
+    RF12_DATA_RATE_CMD = 0xC600,
+    RF12_DATA_RATE_9 = RF12_DATA_RATE_CMD | 0x02,  // Approx 115200 bps
+    RF12_DATA_RATE_8 = RF12_DATA_RATE_CMD | 0x05,  // Approx  57600 bps
+    RF12_DATA_RATE_7 = RF12_DATA_RATE_CMD | 0x06,  // Approx  49200 bps
+    RF12_DATA_RATE_6 = RF12_DATA_RATE_CMD | 0x08,  // Approx  38400 bps
+    RF12_DATA_RATE_5 = RF12_DATA_RATE_CMD | 0x11,  // Approx  19200 bps
+    RF12_DATA_RATE_4 = RF12_DATA_RATE_CMD | 0x23,  // Approx   9600 bps
+    RF12_DATA_RATE_3 = RF12_DATA_RATE_CMD | 0x47,  // Approx   4800 bps
+    RF12_DATA_RATE_2 = RF12_DATA_RATE_CMD | 0x91,  // Approx   2400 bps
+    RF12_DATA_RATE_1 = RF12_DATA_RATE_CMD | 0x9E,  // Approx   1200 bps
+    RF12_DATA_RATE_DEFAULT = RF12_DATA_RATE_7,
+};
+
+// A radio profile: the data rate, as one of rf12DataRates, the
+// receiver's bandwidth and the transmitter's FSK deviation, both in
+// kHz, and the number of bits in the receive FIFO that raises an
+// interrupt. The bandwidth is one of 67, 134, 200, 270, 340 or 400,
+// the deviation a multiple of 15 from 15 to 240 and the FIFO level
+// 8 to 15. Anything else doesn't compile.
+template <uint16_t DataRate, uint16_t Bandwidth, byte Deviation,
+          byte FifoLevel = 8>
+  class RF12Profile
+    {
+    static const byte BANDWIDTH_BITS =
+      Bandwidth == 400 ? 1 : Bandwidth == 340 ? 2 : Bandwidth == 270 ? 3
+      : Bandwidth == 200 ? 4 : Bandwidth == 134 ? 5 : Bandwidth == 67 ? 6
+      : 0;
+    typedef char BadBandwidth[BANDWIDTH_BITS != 0 ? 1 : -1];
+    typedef char BadDeviation
+      [Deviation >= 15 && Deviation <= 240 && Deviation % 15 == 0 ? 1 : -1];
+    typedef char BadFifoLevel[FifoLevel >= 8 && FifoLevel <= 15 ? 1 : -1];
+
+public:
+    static const uint16_t DATA_RATE = DataRate;
+    // VDI, fast, Bandwidth, LNA 0 dB, RSSI -91 dBm.
+    static const uint16_t RX_CONTROL = 0x9402 | (BANDWIDTH_BITS << 5);
+    // !mp, Deviation, MAX OUT.
+    static const uint16_t TX_CONFIG = 0x9800 | ((Deviation / 15 - 1) << 4);
+    // FifoLevel, ff and dr set, see fifoCommand() in _RF12Base.
+    static const uint16_t FIFO = 0xCA03 | (FifoLevel << 4);
+
+    // Time on the air of a byte. The rate is 10000 / 29 / (R + 1)
+    // kbps, divided by 8 more if bit 7 is set.
+    static const uint16_t BYTE_US =
+      (232UL * ((DataRate & 0x7F) + 1) * (DataRate & 0x80 ? 8 : 1) + 9)
+      / 10;
+    // The time the ISR has to take a byte out of the FIFO before the
+    // next one overruns it.
+    static const uint16_t RX_DEADLINE_US = BYTE_US * (16 - FifoLevel) / 8;
+    };
+
+// The bandwidth and deviation grow with the rate. 49.2 kbps is what
+// the driver has always used.
+typedef RF12Profile<RF12_DATA_RATE_4, 67, 45> RF12Profile9k6;
+typedef RF12Profile<RF12_DATA_RATE_6, 134, 90> RF12Profile38k4;
+typedef RF12Profile<RF12_DATA_RATE_7, 134, 90> RF12Profile49k2;
+typedef RF12Profile<RF12_DATA_RATE_8, 200, 90> RF12Profile57k6;
+typedef RF12Profile<RF12_DATA_RATE_9, 340, 120> RF12Profile115k2;
+
+// The profile the driver uses. Define it before including this to
+// change it. All nodes in a group must use the same.
+#ifndef RF12_PROFILE
+# define RF12_PROFILE RF12Profile49k2
+#endif
+
+template <class RFM_IRQ, class SelectPin, class CRC = RF12_CRC,
+          class Profile = RF12_PROFILE>
+  class _RF12Base
     {
-    static const uint16_t MIN_SEND_INTERVAL = 500;  // in ms.
     static volatile uint16_t _crc;  // running crc value, should be
                                     // zero at end
 
-    static uint16_t _lastSend;
+    // Listen before talk: a busy channel puts sending off for a
+    // random number of SLOT_MS slots, up to 2^_backoff of them. That
+    // doubles each time the channel is still busy, up to
+    // MAX_BACKOFF, and starts again at 0 once we get to send.
+    static const byte SLOT_MS = 4;
+    static const byte MAX_BACKOFF = 5;
+    static byte _backoff;
+    static uint16_t _waitFrom;
+    static uint16_t _wait;
+    // Once the channel is found quiet, canSend() keeps saying so for a
+    // slot from _clearFrom, or until sendStart(), so it can be asked
+    // again before sending.
+    static bool _clear;
+    static uint16_t _clearFrom;
+    static uint16_t _random;
+
+    // Airtime: each packet sent adds its time on the air, divided by
+    // RF12_AIRTIME_SHARE percent, to _airtime, which drains as time
+    // passes. Nothing is sent while it is over AIRTIME_BURST, so a
+    // node can send a few packets in a row but not hog the channel.
+    // A byte takes BYTE_US on the air.
+    static const uint16_t BYTE_US = Profile::BYTE_US;
+    static const uint16_t AIRTIME_BURST = 100;  // in ms.
+    static uint16_t _airtime;
+    static uint16_t _airtimeAt;
 
     enum BufferOffset
         {
@@ -145,8 +267,22 @@ template <class RFM_IRQ, class SelectPin> class _RF12Base
         LENGTH = 2,
         DATA = 3
         };
-    static volatile byte _buf[];  // recv/xmit buf including hdr &
-                                  // crc bytes
+    static byte _txbuf[];         // xmit buf including hdr & crc bytes
+
+    // Received frames, including hdr & crc bytes. The ISR fills
+    // _rxbuf[_rxnext]. The _rxcount frames before it have been
+    // received, from _rxtail on, and the application is looking at
+    // the one at _rxtail if _rxheld. A set bit in _rxbad is a frame
+    // with a bad CRC.
+    static volatile byte _rxbuf[][RF_MAX];
+    static volatile byte _rxnext;
+    static volatile byte _rxcount;
+    static volatile byte _rxbad;
+    // _rxbad has a bit for each frame.
+    typedef char BadRXFrames
+      [RF12_RX_FRAMES >= 1 && RF12_RX_FRAMES <= 8 ? 1 : -1];
+    static byte _rxtail;
+    static bool _rxheld;
 
     // transceiver states, these determine what to do with each interrupt
     enum TransceiverState
@@ -165,35 +301,42 @@ template <class RFM_IRQ, class SelectPin> class _RF12Base
         };
 
     static uint8_t _group;               // network group
-    static volatile byte _rxfill;     // number of data bytes in rf12_buf
+    static volatile byte _rxfill;     // number of bytes in _rxbuf[_rxnext]
     static volatile int8_t _rxstate;     // current transceiver state
 
-#define RETRIES     8               // stop retrying after 8 times
-#define RETRY_MS    1000            // resend packet every second until ack'ed
-
-    static uint8_t _ezInterval;          // number of seconds between transmits
-    static uint8_t _ezSendBuf[RF12_MAXDATA]; // data to send
-    static char _ezSendLen;              // number of bytes to send
-    static uint8_t _ezPending;           // remaining number of retries
-    static long _ezNextSend[2];          // when was last retry [0] or
-                                         // data [1] sent
+    // Easy transmission, see easyInit(). _ezPending counts down the
+    // sends left, from EASY_RETRIES when there is new data. The
+    // first send of new data was at _ezDataAt, if _ezDataSent, and
+    // the last send of any kind at _ezSentAt. _ezAcked says the data
+    // in _ezSendBuf got its ack.
+    static const byte EASY_RETRIES = 8;
+    static const uint16_t EASY_RETRY_MS = 1000;
+    static byte _ezInterval;             // seconds between new data
+    static byte _ezHeader;               // header to send with
+    static byte _ezAckHeader;            // header of the ack
+    static byte _ezSendBuf[RF12_MAXDATA];
+    static byte _ezSendLen;
+    static byte _ezPending;
+    static bool _ezDataSent;
+    static bool _ezAcked;
+    static uint16_t _ezDataAt;
+    static uint16_t _ezSentAt;
 
     static uint32_t _seqNum;             // encrypted send sequence number
     static uint32_t _cryptKey[4];        // encryption key to use
-    static void (*_crypter)(uint8_t);    // does en-/decryption (null
+    static void (*_crypter)(bool);       // does en-/decryption (null
                                          // if disabled)
+    static long _rxseq;                  // sequence number of the
+                                         // held packet, or -1
 
 public:
     // only needed if you want to init the SPI bus before
     // rf12_initialize does it
     static void spiInit(void)
         {
-	SelectPin::set();
-	SelectPin::modeOutput();
-
-        // maybe use clk/2 (2x 1/4th) for sending (and clk/8 for recv,
-        // see rf12_xferSlow)
-        SPISS::init(0, F_CPU > 10000000);
+        // clk/2 for sending and clk/8 for recv at 16 MHz, see
+        // xferSlow()
+        FastDevice::init();
 
         RFM_IRQ::modeInput();
         // pullup (apparently)
@@ -226,27 +369,24 @@ public:
         xfer(0x80C7 | (band << 4));      // EL (ena TX), EF (ena RX
                                          // FIFO), 12.0pF
         xfer(0xA640); // 868MHz 
-        xfer(0xC606); // approx 49.2 Kbps, i.e. 10000/29/(1+6) Kbps
-        xfer(0x94A2); // VDI,FAST,134kHz,0dBm,-91dBm 
+        xfer(Profile::DATA_RATE);
+        xfer(Profile::RX_CONTROL);
         xfer(0xC2AC); // AL,!ml,DIG,DQD4 
+        xfer(fifoCommand());
         if (group != 0)
-            {
-            xfer(0xCA83); // FIFO8,2-SYNC,!ff,DR 
             xfer(0xCE00 | group); // SYNC=2DXX； 
-            }
         else
-            {
-            xfer(0xCA8B); // FIFO8,1-SYNC,!ff,DR 
             xfer(0xCE2D); // SYNC=2D； 
-            }
         xfer(0xC483); // @PWR,NO RSTRIC,!st,!fi,OE,EN 
-        xfer(0x9850); // !mp,90kHz,MAX OUT 
+        xfer(Profile::TX_CONFIG);
         xfer(0xCC77); // OB1，OB0, LPX,！ddy，DDIT，BW0 
         xfer(0xE000); // NOT USE 
         xfer(0xC800); // NOT USE 
         xfer(0xC049); // 1.66MHz,3.1V 
 
         _rxstate = TXIDLE;
+        _rxnext = _rxtail = _rxcount = 0;
+        _rxheld = false;
         if (enableInterrupt)
             Interrupt0::enable(Interrupt0::LOW);
         else
@@ -254,185 +394,492 @@ public:
         }
 
     // Call this frequently, returns true if a packet has been
-    // received. You should process the packet before calling this
-    // again, it may get overwritten once you have.
+    // received. header(), length(), data() and goodCRC() then give
+    // that packet until this is called again. Other packets go on
+    // being received meanwhile, up to RF12_RX_FRAMES - 1 of them.
     static bool recvDone(void)
         {
-        if (_rxstate == TXRECV && (_rxfill >= _buf[LENGTH] + 5
-                                   || _rxfill >= RF_MAX))
-            {
-            _rxstate = TXIDLE;
-            if (_buf[LENGTH] > RF12_MAXDATA)
-                _crc = 1; // force bad crc if packet length is invalid
-            // Allow an immediate transmit
-            _lastSend = Clock16::millis() - MIN_SEND_INTERVAL - 1;
-	    return true;
-            }
         enableReceive();
-        return false;
+        return recvDoneNoEnable();
         }
 
-    // Alternatively, call this to detect receives without re-enabling
-    // receive. Obviously you need to enable it yourself when ready!
-    // This can be safely called multiple times before processing
-    // data.
+    // Alternatively, call this to detect receives without letting go
+    // of the packet. This can be safely called multiple times before
+    // processing data, and returns the same packet until
+    // enableReceive() is called.
     static bool recvDoneNoEnable(void)
         {
-        if ((_rxstate == TXRECV || _rxstate == TXIDLE)
-            && (_rxfill >= _buf[LENGTH] + 5 || _rxfill >= RF_MAX))
-            {
-            _rxstate = TXIDLE;
-            if (_buf[LENGTH] > RF12_MAXDATA)
-                _crc = 1; // force bad crc if packet length is invalid
-            // Allow an immediate transmit
-            _lastSend = Clock16::millis() - MIN_SEND_INTERVAL - 1;
-	    return true;
-            }
-        return false;
+        if (_rxheld)
+            return true;
+        if (_rxcount == 0)
+            return false;
+        _rxheld = true;
+        if (goodCRC() && _crypter != 0)
+            _crypter(false);
+        else
+            _rxseq = -1;
+        return true;
         }
 
-    // Once this is called, received data can also change. Receive is
-    // only enabled if neither transmit nor receive is in progress.
+    // Let go of the packet given by recvDoneNoEnable(), if any, and
+    // start receiving if the radio is idle and there is room.
     static void enableReceive()
         {
-        if (_rxstate == TXIDLE)
+        release();
+        if (_rxstate == TXIDLE && _rxcount < RF12_RX_FRAMES)
             recvStart();
         }
 
-    static bool goodCRC() { return _crc == 0; }
-    static byte header() { return _buf[HEADER]; }
-    static void setHeader(byte hdr) { _buf[HEADER] = hdr; }
-    static byte length() { return _buf[LENGTH]; }
-    // This was originally declared volatile, but it is only volatile
-    // if you have a bug, so that has been removed.
-    static const byte *data() { return (byte *)&_buf[DATA]; }
+    // The packet given by recvDone() or recvDoneNoEnable(). The ISR
+    // doesn't write to it until it is let go, so it isn't volatile.
+    static bool goodCRC() { return !(_rxbad & (1 << _rxtail)); }
+    static byte header() { return frame()[HEADER]; }
+    static byte length() { return frame()[LENGTH]; }
+    static const byte *data() { return frame() + DATA; }
+
+    // The packet to send.
+    static void setHeader(byte hdr) { _txbuf[HEADER] = hdr; }
 
     // call this to check whether a new transmission can be started
     // returns true when a new transmission may be started with
-    // rf12_sendStart()
+    // rf12_sendStart(). That is as soon as the channel is quiet, and
+    // we are neither backing off nor over our share of airtime, so
+    // the more idle the channel the more we can send. If the receiver
+    // is off, this turns it on to listen and says no for a slot. It
+    // can't listen, so says no, while the ring of received packets is
+    // full. The receiver is left running until sendStart().
     static bool canSend(void)
         {
-	if (Clock16::millis() - _lastSend < MIN_SEND_INTERVAL)
-	    return false;
-	if (_rxstate == TXIDLE)
-            return true;
-        // no need to test with interrupts disabled: state TXRECV is
-        // only reached outside of ISR and we don't care if rxfill
-        // jumps from 0 to 1 here
-        if (_rxstate == TXRECV && _rxfill == 0 &&
-            (xferByte(0x00) & (RF_RSSI_BIT >> 8)) == 0)
+        uint16_t now = Clock16::millis();
+
+        if (_clear)
             {
-            xfer(RF_IDLE_MODE); // stop receiver
-            //XXX just in case, don't know whether these RF12 reads are needed!
-            // rf12_xfer(0x0000); // status register
-            // rf12_xfer(RF_RX_FIFO_READ); // fifo read
-            _rxstate = TXIDLE;
-            _buf[GROUP] = _group;
+            if (_rxstate == TXRECV && _rxfill == 0
+                && (uint16_t)(now - _clearFrom) < SLOT_MS)
+                return true;
+            _clear = false;
+            }
+        if (_wait != 0)
+            {
+            if ((uint16_t)(now - _waitFrom) < _wait)
+                return false;
+            _wait = 0;
+            }
+        uint16_t drained = now - _airtimeAt;
+        _airtime = _airtime > drained ? _airtime - drained : 0;
+        _airtimeAt = now;
+        if (_airtime > AIRTIME_BURST)
+            return false;
+        if (_rxstate == TXIDLE)
+            {
+            // Listen first. There must be room to receive into, and
+            // the RSSI takes a moment to settle.
+            if (_rxcount < RF12_RX_FRAMES)
+                {
+                recvStart();
+                _waitFrom = now;
+                _wait = SLOT_MS;
+                }
+            return false;
+            }
+        if (_rxstate != TXRECV)
+            return false;
+        // no need to test with interrupts disabled: we don't care if
+        // rxfill jumps from 0 to 1 here
+        if (_rxfill == 0 && (xferSlow(0x0000) & RF_RSSI_BIT) == 0)
+            {
+            _clear = true;
+            _clearFrom = now;
+            _backoff = 0;
             return true;
             }
+        // Someone else is talking.
+        if (_backoff < MAX_BACKOFF)
+            ++_backoff;
+        _waitFrom = now;
+        _wait = SLOT_MS * (1 + (random() & ((1 << _backoff) - 1)));
         return false;
         }
 
     // call this only when recvDone() or canSend() return true
     static void sendStart()
         {
+        // After recvDone() the receiver may still be running. Stop it
+        // before touching _crc, which the ISR would otherwise go on
+        // feeding received bytes to. A frame half received is lost.
+        stopReceive();
+        _clear = false;
+        if (_crypter != 0)
+            _crypter(true);
+        _txbuf[GROUP] = _group;
         _crc = ~0;
-        _crc = _crc16_update(_crc, _buf[GROUP]);
+        _crc = CRC::update(_crc, _txbuf[GROUP]);
         _rxstate = TXPRE1;
         xfer(RF_XMITTER_ON); // bytes will be fed via interrupts
-	_lastSend = Clock16::millis();
+        // preamble, sync, header, length, data, crc and tail
+        _airtime += (uint32_t)(_txbuf[LENGTH] + 10) * BYTE_US
+          / (10 * RF12_AIRTIME_SHARE);
         }
 
     static void sendStart(const void *ptr, uint8_t len)
         {
-        _buf[LENGTH] = len;
-        memcpy((void *)&_buf[DATA], ptr, len);
+        _txbuf[LENGTH] = len;
+        memcpy(&_txbuf[DATA], ptr, len);
         sendStart();
         }
 
     static void clearData()
-	{ _buf[LENGTH] = 0; }
+	{ _txbuf[LENGTH] = 0; }
 
     static void writeData(const byte *data, byte length)
 	{
-	memcpy((void *)&_buf[DATA + _buf[LENGTH]], data, length);
-	_buf[LENGTH] += length;
+	memcpy(&_txbuf[DATA + _txbuf[LENGTH]], data, length);
+	_txbuf[LENGTH] += length;
 	}
 
-// wait for send to finish, sleep mode: 0=none, 1=idle, 2=standby, 3=powerdown
-void rf12_sendWait(uint8_t mode);
+    // How sendWait() waits. The RFM12B's interrupt wakes the CPU
+    // from any of them. In WAIT_STANDBY and WAIT_POWER_DOWN the clock
+    // stops, so Clock16::millis() falls behind by the time the packet
+    // takes. WAIT_POWER_DOWN is only for CPUs whose fuses make them
+    // start up in a few cycles, else use WAIT_STANDBY.
+    enum WaitMode
+        {
+        WAIT_BUSY,
+        WAIT_IDLE,
+        WAIT_STANDBY,
+        WAIT_POWER_DOWN,
+        };
+
+    // Returns once the packet being sent, if any, has gone, with the
+    // CPU asleep as |mode| says meanwhile.
+    static void sendWait(byte mode)
+        {
+        if (mode != WAIT_BUSY)
+            set_sleep_mode(mode == WAIT_POWER_DOWN ? SLEEP_MODE_PWR_DOWN
+                           : mode == WAIT_STANDBY ? SLEEP_MODE_STANDBY
+                           : SLEEP_MODE_IDLE);
+        for ( ; ; )
+            {
+            cli();
+            if (!sending())
+                break;
+            if (mode == WAIT_BUSY)
+                {
+                sei();
+                continue;
+                }
+            // sleep_cpu() goes before any interrupt after sei().
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+            }
+        sei();
+        }
 
 // this simulates OOK by turning the transmitter on and off via SPI commands
 // use this only when the radio was initialized with a fake zero node ID
 void rf12_onOff(uint8_t value);
 
-// power off the RF12, ms > 0 sets watchdog to wake up again after N * 32 ms
-// note: once off, calling this with -1 can be used to bring the RF12 back up
-void rf12_sleep(char n);
+    // Turns the radio off, for good with RF12_SLEEP, or until its
+    // wake-up timer goes off after |n| * 32 ms, so up to about 8
+    // seconds. Either way wakeup() turns it back on, idle, and
+    // recvDone() then starts receiving again. The wake-up timer
+    // raises the interrupt, which wakes the CPU even from power down,
+    // so it can time the CPU's sleep as well as the radio's, in place
+    // of the watchdog.
+    static void sleep(byte n)
+        {
+        xfer(RF_WAKEUP_TIMER | 0x0500 | n);
+        xfer(RF_SLEEP_MODE);
+        if (n > 0)
+            xfer(RF_WAKEUP_MODE);
+        _rxstate = TXIDLE;
+        }
+    static void wakeup()
+        {
+        xfer(RF_IDLE_MODE);
+        _rxstate = TXIDLE;
+        }
 
-// returns true of the supply voltage is below 3.1V
-char rf12_lowbat(void);
+    // True if the supply voltage is below 3.1V.
+    static bool lowbat()
+        { return (control(0x0000) & RF_LBD_BIT) != 0; }
 
-// set up the easy tranmission mode, arg is number of seconds between packets
-void rf12_easyInit(uint8_t secs);
+    // Easy transmission: easySend() hands data over, and easyPoll()
+    // sends it with header |hdr| until a packet with header |ackHdr|
+    // comes back, every EASY_RETRY_MS, EASY_RETRIES times at most.
+    // New data goes out at most every |secs| seconds, at most 65, or
+    // as often as canSend() allows if it is 0.
+    static void easyInit(byte secs, byte hdr, byte ackHdr)
+        {
+        _ezInterval = secs;
+        _ezHeader = hdr;
+        _ezAckHeader = ackHdr;
+        _ezPending = 0;
+        _ezDataSent = false;
+        }
 
-// call this often to keep the easy transmission mode going
-char rf12_easyPoll(void);
+    // Call this often to keep easy transmission going. Returns 1 if
+    // the ack brought data back, which data() gives until the next
+    // call, -1 while there is data to send or resend, and 0 once it
+    // has been acked or given up on. Other packets received meanwhile
+    // are dropped.
+    static int8_t easyPoll()
+        {
+        if (recvDone() && goodCRC() && header() == _ezAckHeader)
+            {
+            _ezPending = 0;
+            _ezAcked = true;
+            if (length() > 0)
+                return 1;
+            }
+        if (_ezPending > 0)
+            {
+            uint16_t now = Clock16::millis();
+            bool newData = _ezPending == EASY_RETRIES;
+            bool due = newData
+              ? !_ezDataSent || (uint16_t)(now - _ezDataAt)
+                                  >= _ezInterval * 1000U
+              : (uint16_t)(now - _ezSentAt) >= EASY_RETRY_MS;
+            if (due && canSend())
+                {
+                if (newData)
+                    {
+                    _ezDataAt = now;
+                    _ezDataSent = true;
+                    }
+                _ezSentAt = now;
+                setHeader(_ezHeader);
+                sendStart(_ezSendBuf, _ezSendLen);
+                --_ezPending;
+                }
+            }
+        return _ezPending ? -1 : 0;
+        }
 
-// send new data using the easy transmission mode, buffer gets copied to driver
-char rf12_easySend(const void* data, uint8_t size);
+    // Sends |size| bytes at |data| by easy transmission, or resends
+    // what was last given if |data| is 0. Returns false, and doesn't
+    // send, if the data is the same as what was last sent and acked.
+    // The data is copied.
+    static bool easySend(const void *data, byte size)
+        {
+        if (data != 0 && size != 0)
+            {
+            if (_ezAcked && size == _ezSendLen
+                && memcmp(_ezSendBuf, data, size) == 0)
+                return false;
+            memcpy(_ezSendBuf, data, size);
+            _ezSendLen = size;
+            }
+        _ezAcked = false;
+        _ezPending = EASY_RETRIES;
+        return true;
+        }
 
-// enable encryption (null arg disables it again)
-void rf12_encrypt(const uint8_t*);
+    // Turns encryption on with the 16 byte XXTEA key at |key| in
+    // EEPROM, e.g. RF12_EEPROM_EKEY, or off if |key| is 0. Packets
+    // sent then carry a sequence number, which takes up to 4 bytes,
+    // so the data must be at most RF12_MAXDATA - 4; more is cut to
+    // that when sent. Decryption
+    // happens only to packets with a good CRC. sequence() gives
+    // their sequence number.
+    static void encrypt(const byte *key)
+        {
+        if (key != 0)
+            {
+            eeprom_read_block(_cryptKey, key, sizeof _cryptKey);
+            _crypter = crypt;
+            }
+        else
+            _crypter = 0;
+        }
 
-// low-level control of the RFM12B via direct register access
-// http://tools.jeelabs.org/rfm12b is useful for calculating these
-uint16_t rf12_control(uint16_t cmd);
+    // The sequence number of the encrypted packet from recvDone(), or
+    // -1 if it wasn't decrypted.
+    static long sequence() { return _rxseq; }
 
-// See http://blog.strobotics.com.au/2009/07/27/rfm12-tutorial-part-3a/
-// Transmissions are packetized, don't assume you can sustain these speeds! 
-//
-// Note - data rates are approximate. For higher data rates you may need to
-// alter receiver radio bandwidth and transmitter modulator bandwidth.
-// Note that bit 7 is a prescaler - don't just interpolate rates between
-// RF12_DATA_RATE_3 and RF12_DATA_RATE_2.
-enum rf12DataRates {
-    RF12_DATA_RATE_CMD = 0xC600,
-    RF12_DATA_RATE_9 = RF12_DATA_RATE_CMD | 0x02,  // Approx 115200 bps
-    RF12_DATA_RATE_8 = RF12_DATA_RATE_CMD | 0x05,  // Approx  57600 bps
-    RF12_DATA_RATE_7 = RF12_DATA_RATE_CMD | 0x06,  // Approx  49200 bps
-    RF12_DATA_RATE_6 = RF12_DATA_RATE_CMD | 0x08,  // Approx  38400 bps
-    RF12_DATA_RATE_5 = RF12_DATA_RATE_CMD | 0x11,  // Approx  19200 bps
-    RF12_DATA_RATE_4 = RF12_DATA_RATE_CMD | 0x23,  // Approx   9600 bps
-    RF12_DATA_RATE_3 = RF12_DATA_RATE_CMD | 0x47,  // Approx   4800 bps
-    RF12_DATA_RATE_2 = RF12_DATA_RATE_CMD | 0x91,  // Approx   2400 bps
-    RF12_DATA_RATE_1 = RF12_DATA_RATE_CMD | 0x9E,  // Approx   1200 bps
-    RF12_DATA_RATE_DEFAULT = RF12_DATA_RATE_7,
-};
+    // Low-level control of the RFM12B by its commands, see
+    // http://tools.jeelabs.org/rfm12b
+    static uint16_t control(uint16_t cmd)
+        { return xferSlow(cmd); }
 
     static void interrupt()
+        {
+        // If we interrupted someone else's SPI transaction, wait
+        // for it to finish. RFM_IRQ is level triggered, so this is
+        // called again as soon as the interrupt is unmasked.
+        if (!SPIBus::tryAcquire(resumeInterrupt))
+            {
+            Interrupt0::disable();
+            return;
+            }
+        service();
+        SPIBus::release();
+        }
+
+private:
+    static void resumeInterrupt()
+        { Interrupt0::enable(Interrupt0::LOW); }
+
+    // xorshift, stirred with the clock so that nodes which start
+    // together soon drift apart.
+    static uint16_t random()
+        {
+        uint16_t x = _random ^ Clock16::millis();
+
+        x ^= x << 7;
+        x ^= x >> 9;
+        x ^= x << 8;
+        return _random = x;
+        }
+
+    static const byte *frame()
+        { return (const byte *)_rxbuf[_rxtail]; }
+    // Stops the receiver, if it is running, without the ISR seeing
+    // it half done.
+    static void stopReceive()
+        {
+        ScopedInterruptDisable cli;
+        if (_rxstate == TXRECV)
+            xfer(RF_IDLE_MODE);
+        _rxstate = TXIDLE;
+        }
+    // A packet is being sent.
+    static bool sending()
+        { return _rxstate < TXIDLE || _rxstate > TXRECV; }
+
+    // XXTEA over the data of the packet being sent, after adding the
+    // sequence number, or of the packet held, taking it off. The top
+    // 2 bits of the last byte say how many more bytes of sequence
+    // number come before it.
+    static void crypt(bool send)
+        {
+        static const uint32_t DELTA = 0x9E3779B9;
+        static const byte ROUNDS = 6;
+        byte *buf = send ? _txbuf : (byte *)_rxbuf[_rxtail];
+        byte *data = buf + DATA;
+        uint32_t *v = (uint32_t *)data;
+        uint32_t y, z, sum;
+        byte n, p, e;
+
+        if (send)
+            {
+            // Room for the sequence number: longer data is cut short
+            // rather than written past the end of _txbuf.
+            byte len = buf[LENGTH];
+            if (len > RF12_MAXDATA - 4)
+                len = RF12_MAXDATA - 4;
+            *(uint32_t *)(data + len) = ++_seqNum;
+            byte pad = 3 - (len & 3);
+            len += pad;
+            data[len] = (data[len] & 0x3F) | (pad << 6);
+            buf[LENGTH] = ++len;
+            n = len / 4;
+            if (n < 2)
+                return;
+            sum = 0;
+            z = v[n - 1];
+            for (byte r = 0; r < ROUNDS; ++r)
+                {
+                sum += DELTA;
+                e = (sum >> 2) & 3;
+                for (p = 0; p < n - 1; ++p)
+                    {
+                    y = v[p + 1];
+                    z = v[p] += mx(y, z, sum, p, e);
+                    }
+                y = v[0];
+                z = v[n - 1] += mx(y, z, sum, p, e);
+                }
+            return;
+            }
+
+        byte len = buf[LENGTH];
+        if (len == 0)
+            {
+            _rxseq = -1;
+            return;
+            }
+        n = len / 4;
+        if (n > 1)
+            {
+            sum = ROUNDS * DELTA;
+            y = v[0];
+            do
+                {
+                e = (sum >> 2) & 3;
+                for (p = n - 1; p > 0; --p)
+                    {
+                    z = v[p - 1];
+                    y = v[p] -= mx(y, z, sum, p, e);
+                    }
+                z = v[n - 1];
+                y = v[0] -= mx(y, z, sum, p, e);
+                }
+            while ((sum -= DELTA) != 0);
+            }
+        byte pad = data[--len] >> 6;
+        long seq = data[len] & 0x3F;
+        while (pad-- > 0 && len > 0)
+            seq = (seq << 8) | data[--len];
+        buf[LENGTH] = len;
+        _rxseq = seq;
+        }
+    static uint32_t mx(uint32_t y, uint32_t z, uint32_t sum, byte p, byte e)
+        {
+        return ((z >> 5 ^ y << 2) + (y >> 3 ^ z << 4))
+          ^ ((sum ^ y) + (_cryptKey[(p & 3) ^ e] ^ z));
+        }
+    // Give the packet the application was looking at back to the ISR.
+    static void release()
+        {
+        if (!_rxheld)
+            return;
+        _rxheld = false;
+        if (++_rxtail == RF12_RX_FRAMES)
+            _rxtail = 0;
+        ScopedInterruptDisable cli;
+        --_rxcount;
+        }
+
+    static uint16_t fifoCommand()
+        {
+        return _group != 0
+          ? Profile::FIFO             // 2-SYNC,!ff,DR
+          : Profile::FIFO | 0x0008;   // 1-SYNC,!ff,DR
+        }
+
+    static void service()
         {
         // a transfer of 2x 16 bits @ 2 MHz over SPI takes 2x 8 us
         // inside this ISR correction: now takes 2 + 8 µs, since
         // sending can be done at 8 MHz
         xfer(0x0000);
-    
+
+        // The wake-up timer or low battery: reading the status was
+        // all it wanted.
+        if (_rxstate == TXIDLE)
+            return;
+
         if (_rxstate == TXRECV)
             {
             uint8_t in = xferSlow(RF_RX_FIFO_READ);
+            volatile byte *buf = _rxbuf[_rxnext];
 
             // Shouldn't happen?
             if (_rxfill >= RF_MAX)
                 return;
 
             if (_rxfill == 0 && _group != 0)
-                _buf[_rxfill++] = _group;
+                buf[_rxfill++] = _group;
             
-            _buf[_rxfill++] = in;
-            _crc = _crc16_update(_crc, in);
+            buf[_rxfill++] = in;
+            uint16_t crc = CRC::update(_crc, in);
+            _crc = crc;
 
-            if (_rxfill >= _buf[LENGTH] + 5 || _rxfill >= RF_MAX)
-                xfer(RF_IDLE_MODE);
+            if (_rxfill >= buf[LENGTH] + 5 || _rxfill >= RF_MAX)
+                received(buf[LENGTH] <= RF12_MAXDATA && crc == 0);
             }
         else
             {
@@ -440,17 +887,17 @@ enum rf12DataRates {
 
             if (_rxstate < 0)
                 {
-                uint8_t pos = 3 + _buf[LENGTH] + _rxstate++;
-                out = _buf[pos];
-                _crc = _crc16_update(_crc, out);
+                uint8_t pos = 3 + _txbuf[LENGTH] + _rxstate++;
+                out = _txbuf[pos];
+                _crc = CRC::update(_crc, out);
                 }
             else
                 switch (_rxstate++)
                     {
                 case TXSYN1: out = 0x2D; break;
                 case TXSYN2:
-                    out = _buf[GROUP];
-                    _rxstate = - (2 + _buf[LENGTH]);
+                    out = _txbuf[GROUP];
+                    _rxstate = - (2 + _txbuf[LENGTH]);
                     break;
                 case TXCRC1: out = _crc; break;
                 case TXCRC2: out = _crc >> 8; break;
@@ -459,10 +906,39 @@ enum rf12DataRates {
                     }
             
             xfer(RF_TXREG_WRITE + out);
+            // Sent, so listen again straight away if there is room.
+            if (_rxstate == TXIDLE && _rxcount < RF12_RX_FRAMES)
+                recvStart();
+            }
+        }
+
+    // The frame being received is complete. Move on to the next one,
+    // if there is room, without turning the receiver off, or else
+    // stop until the application lets go of one.
+    static void received(bool good)
+        {
+        byte bit = 1 << _rxnext;
+
+        if (good)
+            _rxbad &= ~bit;
+        else
+            _rxbad |= bit;
+        if (++_rxnext == RF12_RX_FRAMES)
+            _rxnext = 0;
+        if (++_rxcount < RF12_RX_FRAMES)
+            {
+            // Look for the next sync pattern.
+            xfer(fifoCommand() & ~0x0002);
+            xfer(fifoCommand());
+            recvReset();
+            }
+        else
+            {
+            xfer(RF_IDLE_MODE);
+            _rxstate = TXIDLE;
             }
         }
 
-private:
     // FIXME: unify with arduino++.h
     static uint8_t xferByte(uint8_t out)
         {
@@ -498,38 +974,58 @@ private:
 #endif
         }
 
-    static uint16_t xferSlow(uint16_t cmd)
+    // Reads must stay under 2.5 MHz, writes can go at full speed.
+    typedef SPIDevice<SelectPin,
+                      (F_CPU > 10000000 ? SPI_CLOCK_DIV8 : SPI_CLOCK_DIV4)>
+      SlowDevice;
+
+    // The ISR has to keep up with the profile. Each byte takes two 16
+    // bit transfers at the slow SPI clock, plus the cycles for getting
+    // in and out, the state machine and the CRC. Those 250 cycles are
+    // an estimate, not measured: the bench_rf12_crc tests only time
+    // the CRC. Before it runs, the ISR waits for another device to
+    // let go of the bus, up to SPI_MAX_HOLD_US, or for other
+    // interrupts, for which as long as the ISR takes is kept. So
+    // RF12Profile115k2 wants 16 MHz, and an SPI_MAX_HOLD_US of 38 or
+    // less, e.g. 32 next to an ENC28J60.
+    static const uint32_t ISR_CYCLES =
+      2 * 16 * (F_CPU > 10000000 ? 8 : 4) + 250;
+    static const uint32_t ISR_US = ISR_CYCLES * 1000000 / F_CPU;
+    typedef char ProfileTooFastForCPU
+      [ISR_US + (ISR_US > SPI_MAX_HOLD_US ? ISR_US : SPI_MAX_HOLD_US)
+       <= Profile::RX_DEADLINE_US ? 1 : -1];
+    typedef SPIDevice<SelectPin,
+                      (F_CPU > 10000000 ? SPI_CLOCK_DIV2 : SPI_CLOCK_DIV4)>
+      FastDevice;
+
+    // One 16 bit command frame, high byte first.
+    template <class Device> static uint16_t xferWord(uint16_t cmd)
         {
-        // slow down to under 2.5 MHz
-#if F_CPU > 10000000
-        //bitSet(SPCR, SPR0);
-        //SPCR |= (1 << SPR0);
-        Register::SPCR.set(SPR0);
-#endif
+#ifdef SPDR
+        SPIBus::acquire();
+        Device::select();
+        uint16_t reply = SPI::transfer16(cmd);
+        Device::deselect();
+        SPIBus::release();
+#else
         //bitClear(SS_PORT, SS_BIT);
         SelectPin::clear();
         uint16_t reply = xferByte(cmd >> 8) << 8;
         reply |= xferByte(cmd);
         //bitSet(SS_PORT, SS_BIT);
         SelectPin::set();
-#if F_CPU > 10000000
-        //bitClear(SPCR, SPR0);
-        //SPCR &= ~(1 << SPR0);
-        Register::SPCR.clear(SPR0);
 #endif
         return reply;
         }
 
+    static uint16_t xferSlow(uint16_t cmd)
+        { return xferWord<SlowDevice>(cmd); }
+
     static void xfer(uint16_t cmd)
         {
 #if OPTIMIZE_SPI
         // writing can take place at full speed, even 8 MHz works
-        //bitClear(SS_PORT, SS_BIT);
-        SelectPin::clear();
-        xferByte(cmd >> 8);
-        xferByte(cmd);
-        //bitSet(SS_PORT, SS_BIT);
-        SelectPin::set();
+        xferWord<FastDevice>(cmd);
 #else
         xferSlow(cmd);
 #endif
@@ -537,30 +1033,88 @@ private:
 
     static void recvStart ()
         {
-        _rxfill = _buf[LENGTH] = 0;
+        recvReset();
+        xfer(RF_RECEIVER_ON);
+        }
+    // Get ready to fill _rxbuf[_rxnext].
+    static void recvReset()
+        {
+        _rxfill = _rxbuf[_rxnext][LENGTH] = 0;
         _crc = ~0;
 	// FIXME: _group == 0 is not excepted on the send side...
         if (_group != 0)
-            _crc = _crc16_update(~0, _group);
+            _crc = CRC::update(~0, _group);
         _rxstate = TXRECV;
-        xfer(RF_RECEIVER_ON);
         }
   
     };
 
-template <class RFM_IRQ, class SelectPin>
-  uint16_t _RF12Base<RFM_IRQ, SelectPin>::_lastSend;
-template <class RFM_IRQ, class SelectPin>
-  volatile byte _RF12Base<RFM_IRQ, SelectPin>::_buf[RF_MAX];
-template <class RFM_IRQ, class SelectPin>
-  volatile byte _RF12Base<RFM_IRQ, SelectPin>::_rxfill;
-template <class RFM_IRQ, class SelectPin>
-  volatile uint16_t _RF12Base<RFM_IRQ, SelectPin>::_crc;
-template <class RFM_IRQ, class SelectPin>
-  byte _RF12Base<RFM_IRQ, SelectPin>::_group;
-template <class RFM_IRQ, class SelectPin>
-  volatile int8_t _RF12Base<RFM_IRQ, SelectPin>::_rxstate;
-template <class RFM_IRQ, class SelectPin>
-  void (*_RF12Base<RFM_IRQ, SelectPin>::_crypter)(byte);
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_backoff;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  uint16_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_waitFrom;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  uint16_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_wait;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  bool _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_clear;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  uint16_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_clearFrom;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  uint16_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_random;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  uint16_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_airtime;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  uint16_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_airtimeAt;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_txbuf[RF_MAX];
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  volatile byte
+  _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_rxbuf[RF12_RX_FRAMES][RF_MAX];
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  volatile byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_rxnext;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  volatile byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_rxcount;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  volatile byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_rxbad;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_rxtail;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  bool _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_rxheld;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  volatile byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_rxfill;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  volatile uint16_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_crc;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_group;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  volatile int8_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_rxstate;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_ezInterval;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_ezHeader;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_ezAckHeader;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_ezSendBuf[RF12_MAXDATA];
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_ezSendLen;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  byte _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_ezPending;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  bool _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_ezDataSent;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  bool _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_ezAcked;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  uint16_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_ezDataAt;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  uint16_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_ezSentAt;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  uint32_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_seqNum;
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  uint32_t _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_cryptKey[4];
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  void (*_RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_crypter)(bool);
+template <class RFM_IRQ, class SelectPin, class CRC, class Profile>
+  long _RF12Base<RFM_IRQ, SelectPin, CRC, Profile>::_rxseq = -1;
 
 #endif
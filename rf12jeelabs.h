@@ -52,12 +52,6 @@ template <class RFM_IRQ, class SelectPin> class RF12BJeelabs
   : public _RF12Base<RFM_IRQ, SelectPin>
     {
     static uint8_t _nodeid;              // address of this node
-    static long _seq;             // seq number of encrypted packet (or -1)
-
-    static uint32_t _seqNum;             // encrypted send sequence number
-    static uint32_t _cryptKey[4];        // encryption key to use
-    static void (*_crypter)(uint8_t);    // does en-/decryption (null
-                                         // if disabled)
 
 public:
     // call this once with the node ID, frequency band, and optional group
@@ -80,14 +74,8 @@ public:
 	    return false;
 	if (!(header() & RF12_HDR_DST) || (_nodeid & NODE_ID) == 31 ||
 	    (header() & RF12_HDR_MASK) == (_nodeid & NODE_ID))
-	    {
-	    if (goodCRC() && _crypter != 0)
-		_crypter(0);
-	    else
-		_seq = -1;
 	    return true; // it's a broadcast packet or it's addressed
                           // to this node
-	    }
         return false;
         }
 
@@ -111,6 +99,15 @@ public:
         }
     static bool isAckReply() { return (header() & RF12_HDR_CTL) != 0; }
 
+    // Set up easy transmission, see _RF12Base::easyInit(), to send
+    // to whoever listens and wait for the ack sendAckReply() makes.
+    static void easyInit(byte secs)
+        {
+        byte id = _nodeid & NODE_ID;
+	_RF12Base<RFM_IRQ, SelectPin>::easyInit
+	    (secs, RF12_HDR_ACK | id, RF12_HDR_CTL | RF12_HDR_DST | id);
+        }
+
     // call this only when rf12_recvDone() or rf12_canSend() return true
     static void sendStart(uint8_t hdr)
         {
@@ -121,18 +118,12 @@ public:
         {
         setHeader(hdr & RF12_HDR_DST ? hdr :
 		  (hdr & ~RF12_HDR_MASK) + (_nodeid & NODE_ID));
-        if (_crypter != 0)
-            _crypter(1);
         _RF12Base<RFM_IRQ, SelectPin>::sendStart(ptr, len);
         }
     };
 
 template <class RFM_IRQ, class SelectPin>
   byte RF12BJeelabs<RFM_IRQ, SelectPin>::_nodeid;
-template <class RFM_IRQ, class SelectPin>
-  long RF12BJeelabs<RFM_IRQ, SelectPin>::_seq;
-template <class RFM_IRQ, class SelectPin>
-  void (*RF12BJeelabs<RFM_IRQ, SelectPin>::_crypter)(byte);
 
 // Setup for Jeenodes and Wi/Nanodes.
 typedef RF12BJeelabs<Pin::D2, Pin::B2> RF12B;
@@ -9,14 +9,11 @@ class RF12Star : RF12B  // not public, we want to hide it
 public:
     static void init()
         {
-        // Disable other SPI devices on the Nanode
-        // FIXME: framework should take care of this
+        // Park the other SPI devices on the Nanode
         // ENC28J60
-        Pin::B0::set();
-        Pin::B0::modeOutput();
+        SPIDevice<Pin::B0>::init();
         // 23K256
-        Pin::B1::set();
-        Pin::B1::modeOutput();
+        SPIDevice<Pin::B1>::init();
         RF12B::init(MHZ868, true);
         enableReceive();
         }
@@ -64,6 +61,10 @@ public:
         writeData(data, length);
         sendStart();
         }
+    // Sleep in standby until the packet sent has gone. Clock16 stops
+    // meanwhile, for the few ms that takes.
+    static void sendWait()
+        { RF12B::sendWait(WAIT_STANDBY); }
     };
 
 // FIXME: this should be in rf12base.
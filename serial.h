@@ -34,31 +34,89 @@
 #include <avr/interrupt.h>
 #include <compat/deprecated.h>  // for sbi, cbi
 
-template <byte rx_buffer_size> class RingBuffer
+/*
+  A single producer, single consumer ring buffer. One side (typically
+  an ISR) only ever calls the store/write functions and the other side
+  only ever calls the read functions, so no locking is needed.
+
+  buffer_size must be a power of two. _head and _tail run freely and
+  are masked when indexing, so the whole buffer can be used and there
+  is no division anywhere.
+*/
+template <byte buffer_size> class RingBuffer
     {
+    // Fails to compile if buffer_size is not a power of two.
+    typedef char SizeMustBePowerOfTwo
+      [buffer_size != 0 && (buffer_size & (buffer_size - 1)) == 0 ? 1 : -1];
+
+    static const byte MASK = buffer_size - 1;
+
  public:
-    void store(byte c)
-        {
-        byte i = (_head + 1) % rx_buffer_size;
+    RingBuffer() : _head(0), _tail(0), _overruns(0) {}
+
+    // Producer side.
 
-        // if we should be storing the received character into the location
-        // just before the tail (meaning that the head would advance to the
-        // current location of the tail), we're about to overflow the buffer
-        // and so we don't write the character or advance the head.
-        if (i != _tail)
+    // Returns false if the buffer was full and |c| was dropped, which
+    // is counted in overruns().
+    bool store(byte c)
+        {
+        if (space() == 0)
             {
-            _buffer[_head] = c;
-            _head = i;
+            ++_overruns;
+            return false;
             }
+        _buffer[_head & MASK] = c;
+        barrier();
+        _head = _head + 1;
+        return true;
         }
-    int available(void) const
-        { return (rx_buffer_size + _head - _tail) % rx_buffer_size; }
+    // Number of characters that can be stored before the buffer is full.
+    byte space(void) const
+        { return buffer_size - available(); }
+    // Store up to |n| characters, returns the number actually stored.
+    byte writeBlock(const byte *data, byte n)
+        {
+        byte done = 0;
+        while (done < n)
+            {
+            byte *span;
+            byte len = writeSpan(&span);
+            if (len == 0)
+                break;
+            if (len > n - done)
+                len = n - done;
+            memcpy(span, data + done, len);
+            writeAdvance(len);
+            done += len;
+            }
+        return done;
+        }
+    // Get the contiguous free space at the head, so it can be filled
+    // in place. Returns its length, follow with writeAdvance().
+    byte writeSpan(byte **span)
+        {
+        byte n = space();
+        byte contiguous = buffer_size - (_head & MASK);
+        *span = &_buffer[_head & MASK];
+        return n < contiguous ? n : contiguous;
+        }
+    // Publish |n| characters written into the span from writeSpan().
+    void writeAdvance(byte n)
+        {
+        barrier();
+        _head = _head + n;
+        }
+
+    // Consumer side.
+
+    byte available(void) const
+        { return _head - _tail; }
     int peek(void) const
         {
         if (_head == _tail)
             return -1;
         else
-            return _buffer[_tail];
+            return _buffer[_tail & MASK];
         }
     int read(void)
         {
@@ -67,32 +125,88 @@ template <byte rx_buffer_size> class RingBuffer
             return -1;
         else
             {
-            byte c = _buffer[_tail];
-            _tail = (_tail + 1) % rx_buffer_size;
+            byte c = _buffer[_tail & MASK];
+            barrier();
+            _tail = _tail + 1;
             return c;
             }
         }
+    // Read up to |n| characters, returns the number actually read.
+    byte readBlock(byte *data, byte n)
+        {
+        byte done = 0;
+        while (done < n)
+            {
+            const byte *span;
+            byte len = readSpan(&span);
+            if (len == 0)
+                break;
+            if (len > n - done)
+                len = n - done;
+            memcpy(data + done, span, len);
+            readAdvance(len);
+            done += len;
+            }
+        return done;
+        }
+    // Get the contiguous characters at the tail without consuming
+    // them. Returns their number, follow with readAdvance().
+    byte readSpan(const byte **span) const
+        {
+        byte n = available();
+        byte contiguous = buffer_size - (_tail & MASK);
+        *span = &_buffer[_tail & MASK];
+        return n < contiguous ? n : contiguous;
+        }
+    // Consume |n| characters seen through readSpan().
+    void readAdvance(byte n)
+        {
+        barrier();
+        _tail = _tail + n;
+        }
+    // Discard everything in the buffer.
     void flush(void)
         {
-        // don't reverse this or there may be problems if the RX interrupt
-        // occurs after reading the value of rx_buffer_head but before writing
-        // the value to rx_buffer_tail; the previous value of rx_buffer_head
-        // may be written to rx_buffer_tail, making it appear as if the buffer
-        // were full, not empty.
-        _head = _tail;
+        // Only the consumer may do this, and it owns _tail, so move
+        // the tail up to the head rather than the other way round.
+        _tail = _head;
+        }
+
+    // Number of characters dropped by store() because the buffer was
+    // full.
+    uint16_t overruns() const
+        {
+        ScopedInterruptDisable sid;
+        return _overruns;
+        }
+    void clearOverruns()
+        {
+        ScopedInterruptDisable sid;
+        _overruns = 0;
         }
 
  private:
-    unsigned char _buffer[rx_buffer_size];
+    // Stop the compiler moving buffer accesses past index updates.
+    static void barrier() __attribute__((always_inline))
+        { __asm__ __volatile__ ("" ::: "memory"); }
+
+    byte _buffer[buffer_size];
     volatile byte _head;
     volatile byte _tail;
+    volatile uint16_t _overruns;
     };
 
+// Received characters are buffered in the RingBuffer we derive from,
+// characters to be sent are queued in _tx and fed to the USART by the
+// data register empty interrupt, so write() only blocks if _tx is
+// full.
 template <byte ubrrh, byte ubrrl, byte ucsra, byte ucsrb, byte udr,
-  byte rxen, byte txen, byte rxcie, byte udre, byte u2x, byte size>
+  byte rxen, byte txen, byte rxcie, byte udrie, byte udre, byte txc,
+  byte u2x, byte size, byte tx_size>
     class HardwareSerial : public RingBuffer<size>
     {
  public:
+    HardwareSerial() : _written(false) {}
 
     static const byte ucsrbmask = (1 << rxen) | (1 << txen) | (1 << rxcie);
 
@@ -132,22 +246,89 @@ try_again:
         _SFR_IO8(ubrrl) = baud_setting;
 
         _SFR_IO8(ucsrb) |= ucsrbmask;
-        _SFR_IO8(ucsrb) &= ~udre;        
+        _SFR_IO8(ucsrb) &= ~(1 << udrie);
         }
 
     void end()
         { 
-        _SFR_IO8(ucsrb) &= ~(ucsrbmask | (1 << udre));
+        flush();
+        _SFR_IO8(ucsrb) &= ~(ucsrbmask | (1 << udrie));
         RingBuffer<size>::flush();
         }
 
+    // Queue |c| for transmission, waiting for space if the transmit
+    // buffer is full.
     void write(uint8_t c)
         {
-        while (!(_SFR_IO8(ucsra) & (1 << udre)))
-            ;
-        _SFR_IO8(udr) = c;
+        // If nothing is queued and the data register is free, skip
+        // the buffer altogether.
+        if (_tx.available() == 0 && (_SFR_IO8(ucsra) & (1 << udre)))
+            {
+            ScopedInterruptDisable sid;
+            _SFR_IO8(udr) = c;
+            clearTXC();
+            _written = true;
+            return;
+            }
+        while (!tryWrite(c))
+            poll();
         }
-    
+
+    // Queue |c| for transmission if there is room, never blocks.
+    bool tryWrite(uint8_t c)
+        {
+        if (!_tx.store(c))
+            return false;
+        _written = true;
+        _SFR_IO8(ucsrb) |= 1 << udrie;
+        return true;
+        }
+
+    // Queue as much of |data| as there is room for, never blocks.
+    // Returns the number of characters queued.
+    byte tryWrite(const byte *data, byte n)
+        {
+        n = _tx.writeBlock(data, n);
+        if (n != 0)
+            {
+            _written = true;
+            _SFR_IO8(ucsrb) |= 1 << udrie;
+            }
+        return n;
+        }
+
+    // Number of characters that can be written without blocking.
+    byte availableForWrite() const
+        { return _tx.space(); }
+
+    // Wait until everything written so far has left the USART. Note
+    // that this does not discard received characters, unlike
+    // RingBuffer::flush().
+    void flush()
+        {
+        if (!_written)
+            return;
+        while ((_SFR_IO8(ucsrb) & (1 << udrie))
+               || !(_SFR_IO8(ucsra) & (1 << txc)))
+            poll();
+        }
+
+    // Call from the data register empty interrupt.
+    void dataRegisterEmpty()
+        {
+        // tryWrite() stores and then enables this interrupt, so we
+        // may have sent its character in between and find nothing.
+        if (_tx.available() == 0)
+            {
+            _SFR_IO8(ucsrb) &= ~(1 << udrie);
+            return;
+            }
+        _SFR_IO8(udr) = _tx.read();
+        clearTXC();
+        if (_tx.available() == 0)
+            _SFR_IO8(ucsrb) &= ~(1 << udrie);
+        }
+
     void writeHex(byte b) 
         { HexWriter<HardwareSerial>::write(this, b); }
     void writeHex(uint16_t i) 
@@ -160,25 +341,44 @@ try_again:
         { StringWriter<HardwareSerial>::write_P(this, str); }
     void writeDecimal(uint32_t d, byte digits = 1)
 	{ DecimalWriter<HardwareSerial>::write(this, d, digits); }
+
+ private:
+    // TXC is cleared by writing a one to it, see flush(). The error
+    // flags must be written as zero.
+    void clearTXC()
+        { _SFR_IO8(ucsra) = (_SFR_IO8(ucsra) & (1 << u2x)) | (1 << txc); }
+
+    // If interrupts are disabled the data register empty interrupt
+    // can't drain _tx, so we have to do it by hand when waiting.
+    void poll()
+        {
+        if (!(SREG & (1 << SREG_I))
+            && (_SFR_IO8(ucsrb) & (1 << udrie))
+            && (_SFR_IO8(ucsra) & (1 << udre)))
+            dataRegisterEmpty();
+        }
+
+    RingBuffer<tx_size> _tx;
+    bool _written;
 };
 
 // typedefs for serial classes
 
 #if defined(__AVR_ATmega8__)
 typedef HardwareSerial<NUBRRH, NUBRRL, NUCSRA, NUCSRB, NUDR, 
-  RXEN, TXEN, RXCIE, UDRE, U2X, 128> _Serial;
+  RXEN, TXEN, RXCIE, UDRIE, UDRE, TXC, U2X, 128, 64> _Serial;
 #else
 typedef HardwareSerial<NUBRR0H, NUBRR0L, NUCSR0A, NUCSR0B, NUDR0, 
-  RXEN0, TXEN0, RXCIE0, UDRE0, U2X0, 128> _Serial;
+  RXEN0, TXEN0, RXCIE0, UDRIE0, UDRE0, TXC0, U2X0, 128, 64> _Serial;
 #endif
 
 #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
 typedef HardwareSerial<NUBRR1H, NUBRR1L, NUCSR1A, NUCSR1B, NUDR1, 
-  RXEN1, TXEN1, NRXCIE1, UDRE1, U2X1, 128> _Serial;
+  RXEN1, TXEN1, NRXCIE1, UDRIE1, UDRE1, TXC1, U2X1, 128, 64> _Serial;
 typedef HardwareSerial<NUBRR2H, NUBRR2L, NUCSR2A, NUCSR2B, NUDR2, 
-  RXEN2, TXEN2, NRXCIE2, UDRE2, U2X2, 128> _Serial2;
+  RXEN2, TXEN2, NRXCIE2, UDRIE2, UDRE2, TXC2, U2X2, 128, 64> _Serial2;
 typedef HardwareSerial<NUBRR3H, NUBRR3L, NUCSR3A, NUCSR3B, NUDR3, 
-  RXEN3, TXEN3, NRXCIE3, UDRE3, U2X3, 128> _Serial3;
+  RXEN3, TXEN3, NRXCIE3, UDRIE3, UDRE3, TXC3, U2X3, 128, 64> _Serial3;
 #endif
 
 // Preinstantiate Objects //////////////////////////////////////////////////////
@@ -211,6 +411,26 @@ SIGNAL(SIG_USART3_RECV)
     Serial3.store(c);
     }
 
+SIGNAL(USART0_UDRE_vect)
+    {
+    Serial.dataRegisterEmpty();
+    }
+
+SIGNAL(USART1_UDRE_vect)
+    {
+    Serial1.dataRegisterEmpty();
+    }
+
+SIGNAL(USART2_UDRE_vect)
+    {
+    Serial2.dataRegisterEmpty();
+    }
+
+SIGNAL(USART3_UDRE_vect)
+    {
+    Serial3.dataRegisterEmpty();
+    }
+
 #else
 
 #if defined(__AVR_ATmega8__)
@@ -227,6 +447,15 @@ SIGNAL(USART_RX_vect)
     Serial.store(c);
     }
 
+#if defined(__AVR_ATmega8__)
+SIGNAL(SIG_UART_DATA)
+#else
+SIGNAL(USART_UDRE_vect)
+#endif
+    {
+    Serial.dataRegisterEmpty();
+    }
+
 #endif
 
 // Observer for star slaves (star.h)
@@ -1,8 +1,43 @@
 #ifndef SPI_H
 #define SPI_H
 
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
 #include "arduino--.h"
 
+// For _SPI::writeBlock(), when the bytes aren't wanted.
+class NullSink
+    {
+public:
+    void add(byte) { }
+    };
+
+// For _SPI::writeFrom(), bytes in flash or EEPROM, read one at a
+// time as they are sent, so they never need to be in RAM.
+class ProgmemSource
+    {
+public:
+    ProgmemSource(const void *pmem)
+      : p_((const byte *)pmem)
+        {}
+    byte next() { return pgm_read_byte(p_++); }
+
+private:
+    const byte *p_;
+    };
+
+class EEPROMSource
+    {
+public:
+    EEPROMSource(const void *eeprom)
+      : p_((const byte *)eeprom)
+        {}
+    byte next() { return eeprom_read_byte(p_++); }
+
+private:
+    const byte *p_;
+    };
+
 template <class Sck, class Miso, class Mosi, class Ss> 
     class _SPI
     {
@@ -53,6 +88,115 @@ public:
             ::delayMicroseconds(delay);
         return SPDR;
         }
+
+    // Sends |value| high byte first, in one Ss frame.
+    static uint16_t transfer16(uint16_t value)
+        {
+        Ss::clear();
+        SPDR = value >> 8;
+        byte lo = value;
+        wait();
+        uint16_t reply = SPDR << 8;
+        SPDR = lo;
+        wait();
+        Ss::set();
+        return reply | SPDR;
+        }
+
+    // The block transfers below hold Ss low for all |n| bytes. SPDR
+    // can't be written while a byte is shifting, but everything else
+    // (fetching the next byte, storing the last one) is done while it
+    // is, so the only gap between bytes is the SPIF poll.
+
+    // Sends |n| bytes from |out|, storing what comes back in |in|,
+    // which may be the same buffer.
+    static void transferBlock(const byte *out, byte *in, uint16_t n)
+        {
+        if (n == 0)
+            return;
+        Ss::clear();
+        SPDR = *out++;
+        while (--n)
+            {
+            byte next = *out++;
+            wait();
+            byte b = SPDR;
+            SPDR = next;
+            *in++ = b;
+            }
+        wait();
+        *in = SPDR;
+        Ss::set();
+        }
+
+    static void writeBlock(const byte *out, uint16_t n)
+        {
+        NullSink none;
+        writeBlock(out, n, none);
+        }
+
+    // Also hands each byte to |sink|.add() while the next one is
+    // shifting out, e.g. to checksum it.
+    template <class Sink>
+    static void writeBlock(const byte *out, uint16_t n, Sink &sink)
+        {
+        if (n == 0)
+            return;
+        Ss::clear();
+        byte b = *out++;
+        SPDR = b;
+        while (--n)
+            {
+            sink.add(b);
+            b = *out++;
+            wait();
+            SPDR = b;
+            }
+        sink.add(b);
+        wait();
+        Ss::set();
+        }
+
+    // Like writeBlock(), but the bytes come from |source|.next(),
+    // which is called while the last one is shifting out.
+    template <class Source, class Sink>
+    static void writeFrom(Source &source, uint16_t n, Sink &sink)
+        {
+        if (n == 0)
+            return;
+        Ss::clear();
+        byte b = source.next();
+        SPDR = b;
+        while (--n)
+            {
+            sink.add(b);
+            b = source.next();
+            wait();
+            SPDR = b;
+            }
+        sink.add(b);
+        wait();
+        Ss::set();
+        }
+
+    // Reads |n| bytes into |in|, sending |fill| for each.
+    static void readBlock(byte *in, uint16_t n, byte fill = 0)
+        {
+        if (n == 0)
+            return;
+        Ss::clear();
+        SPDR = fill;
+        while (--n)
+            {
+            wait();
+            byte b = SPDR;
+            SPDR = fill;
+            *in++ = b;
+            }
+        wait();
+        *in = SPDR;
+        Ss::set();
+        }
     };
 
 class NullPin
@@ -69,4 +213,124 @@ public:
 typedef _SPI<Pin::SPI_SCK, Pin::SPI_MISO, Pin::SPI_MOSI, NullPin> SPI;
 typedef _SPI<Pin::SPI_SCK, Pin::SPI_MISO, Pin::SPI_MOSI, Pin::SPI_SS> SPISS;
 
+// Clock dividers for SPIDevice. Bit 7 selects SPI2X, bits 1:0 are
+// SPR1:SPR0.
+enum SPIClock
+    {
+    SPI_CLOCK_DIV2 = 0x80,
+    SPI_CLOCK_DIV4 = 0x00,
+    SPI_CLOCK_DIV8 = 0x81,
+    SPI_CLOCK_DIV16 = 0x01,
+    SPI_CLOCK_DIV32 = 0x82,
+    SPI_CLOCK_DIV64 = 0x02,
+    SPI_CLOCK_DIV128 = 0x03,
+    };
+
+// Clock polarity and phase, as laid out in SPCR.
+enum SPIMode
+    {
+    SPI_MODE0 = 0x00,
+    SPI_MODE1 = 0x04,
+    SPI_MODE2 = 0x08,
+    SPI_MODE3 = 0x0C,
+    };
+
+// The longest, in microseconds, the main program may hold the bus in
+// one go. An interrupt handler waiting for it, like the RF12's, is
+// held up that long, so devices moving blocks of data split them to
+// stay under it (see ENC28J60), and _RF12Base checks that its profile
+// leaves room for it. Define it before including this to change it.
+#ifndef SPI_MAX_HOLD_US
+# define SPI_MAX_HOLD_US 100
+#endif
+
+// Ownership of the hardware SPI bus. The main program takes it with
+// acquire() for each transaction (they may nest). An interrupt handler
+// that needs the bus uses tryAcquire(), which fails if it interrupted
+// a transaction: the handler should then mask its interrupt and return,
+// and |resume| will be called to unmask it when the bus is released.
+// Only one handler can be waiting at a time.
+template <byte unused = 0> class _SPIBus
+    {
+public:
+    static void acquire()
+        { ++_depth; }
+    static bool tryAcquire(void (*resume)())
+        {
+        if (_depth != 0)
+            {
+            _resume = resume;
+            return false;
+            }
+        _depth = 1;
+        return true;
+        }
+    static void release()
+        {
+        if (--_depth == 0 && _resume)
+            {
+            void (*resume)() = _resume;
+            _resume = 0;
+            resume();
+            }
+        }
+
+    // Sets SPCR and SPI2X for |config| (an SPIClock | SPIMode) unless
+    // they already are.
+    static void configure(byte config)
+        {
+        // SPE is always set, so 0 means unknown.
+        byte key = config | (1 << SPE);
+        if (key == _config)
+            return;
+        Register::SPCR = (config & 0x0F) | (1 << SPE) | (1 << MSTR);
+        if (config & 0x80)
+            SPSR |= (1 << SPI2X);
+        else
+            SPSR &= ~(1 << SPI2X);
+        _config = key;
+        }
+    // Call after programming SPCR behind configure()'s back.
+    static void invalidate()
+        { _config = 0; }
+
+private:
+    static volatile byte _depth;
+    static void (* volatile _resume)();
+    static byte _config;
+    };
+
+template <byte unused> volatile byte _SPIBus<unused>::_depth;
+template <byte unused> void (* volatile _SPIBus<unused>::_resume)();
+template <byte unused> byte _SPIBus<unused>::_config;
+
+typedef _SPIBus<> SPIBus;
+
+// A device on the hardware SPI bus, with its own select pin, clock
+// and mode. The bus is only reprogrammed when it changes hands between
+// devices with different settings. Hold the bus (see SPIBus) around
+// select()/deselect().
+template <class SelectPin, byte clock = SPI_CLOCK_DIV4,
+          byte mode = SPI_MODE0>
+    class SPIDevice
+    {
+public:
+    // Also parks the device, so it can be called for devices that
+    // are present but unused.
+    static void init()
+        {
+        SelectPin::set();
+        SelectPin::modeOutput();
+        SPI::init();
+        SPIBus::invalidate();
+        }
+    static void select()
+        {
+        SPIBus::configure(clock | mode);
+        SelectPin::clear();
+        }
+    static void deselect()
+        { SelectPin::set(); }
+    };
+
 #endif
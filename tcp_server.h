@@ -1,5 +1,8 @@
 // -*- mode: c++; indent-tabs-mode: nil; -*-
 
+#include <string.h>
+#include "net_stack.h"
+
 // FIXME: this should not be here
 static char hexdigit(byte b)
     {
@@ -8,12 +11,109 @@ static char hexdigit(byte b)
     return 'a' + b - 10;
     }
 
-template <class MyIP, byte port> class TCPServer
+// Used as TCPServer's clock when none is given. Time never passes, so
+// nothing is retransmitted.
+class NullClock
     {
 public:
-    TCPServer()
-      : len_(0)
-	{}
+    static uint16_t millis() { return 0; }
+    };
+
+// The state TCPServer keeps for each connection.
+struct TCPConnection
+    {
+    enum State
+	{
+	CLOSED,
+	SYN_RECEIVED,
+	ESTABLISHED,
+	};
+    enum Flags
+	{
+	// The response comes from TCPServer::generate().
+	STREAMING = 1,
+	// Our FIN has been sent, with sequence number |fin|.
+	FIN_SENT = 2,
+	// The streamed response is kept open once it ends.
+	KEEP_OPEN = 4,
+	// The streamed response ends at sequence number |fin|, without
+	// a FIN. The connection waits for the next request once that has
+	// been acknowledged.
+	ENDED = 8,
+	// The response is the |length| bytes at |blob| in flash or
+	// EEPROM, rather than from generate().
+	FROM_FLASH = 16,
+	FROM_EEPROM = 32,
+	};
+
+    byte state;
+    byte flags;
+    byte retries;
+    uint8_t mac[6];
+    uint8_t ip[4];
+    uint16_t port;
+    // Our sequence numbers: the oldest unacknowledged, the next to
+    // send and the highest sent. |nxt| goes back to |una| to
+    // retransmit.
+    uint32_t una;
+    uint32_t nxt;
+    uint32_t high;
+    // The sequence number of offset 0 of a streamed response.
+    uint32_t start;
+    uint32_t fin;
+    const byte *blob;
+    uint16_t length;
+    // The next sequence number we expect from the other side.
+    uint32_t rcv;
+    // The other side's receive window and maximum segment size.
+    uint16_t window;
+    uint16_t mss;
+    // When we last sent something, for retransmission.
+    uint16_t sentAt;
+    };
+
+// A TCP listener on |port|, a handler for NetStack (see
+// net_stack.h) which uses the stack's frame buffer. |Derived| is the
+// class derived from it, and each data packet received calls its
+// packetReceived(), which can reply by either
+//
+// - building the reply with add() and friends. The reply must fit in
+//   one packet, is followed by a FIN, and isn't retransmitted.
+//
+// - calling stream(). The response is then produced a segment at a
+//   time by Derived's generate(), and retransmitted (by calling
+//   generate() again) if it isn't acknowledged. Retransmission needs
+//   a real |Clock|, e.g. Clock16. With stream(false) the connection
+//   stays open after the response for another request. Data that
+//   arrives while a response is still being streamed is dropped, so
+//   the other side sends it again later.
+//
+// - calling stream_p() or stream_eeprom(), which stream a response
+//   kept in flash or EEPROM in the same way, e.g. a gzipped page with
+//   its HTTP headers in front. It goes straight from there to the
+//   Ethernet chip, and is summed for the checksum on the way, so it
+//   can be as long as flash allows and is never in RAM.
+//
+// If it does neither, the data is just acknowledged. Derived's
+// connectionOpened() is called when a connection is set up, so that
+// it can forget anything about the last one. The calls are resolved
+// at compile time, so packetReceived(), generate() and
+// connectionOpened() must be public in Derived.
+template <class Derived, class MyIP, uint16_t port, class Clock = NullClock>
+  class TCPListener : public NetHandler
+    {
+public:
+    static const uint16_t ETHERTYPE = ETHTYPE_IP_V;
+    static const byte PROTOCOL = IP_PROTO_TCP_V;
+    static const uint16_t PORT = port;
+
+    TCPListener()
+      : len_(0), streaming_(false), keepOpen_(false), from_(0), blob_(0),
+	length_(0), current_(0), victim_(0), iss_(0)
+	{
+	for (byte i = 0; i < CONNECTIONS; ++i)
+	    conns_[i].state = TCPConnection::CLOSED;
+	}
 
     void add_p(const char *pmem)
 	{ len_ = MyIP::fill_tcp_data_p(buf_, len_, pmem); }
@@ -46,21 +146,133 @@ public:
 	{ return (char *)&(buf_[MyIP::get_tcp_data_pointer()]); }
     size_t getDataLength() const
         { return MyIP::get_tcp_data_len(); }
-    void poll();
+    // Send the response to the packet being processed with
+    // generate(), and then close the connection if |close|.
+    void stream(bool close = true)
+	{
+	streaming_ = true;
+	keepOpen_ = !close;
+	from_ = 0;
+	}
+    // Send the |length| bytes at |pmem| in flash as the response,
+    // like stream().
+    void stream_p(const void *pmem, uint16_t length, bool close = true)
+	{
+	stream(close);
+	from_ = TCPConnection::FROM_FLASH;
+	blob_ = (const byte *)pmem;
+	length_ = length;
+	}
+    // The same from EEPROM.
+    void stream_eeprom(const void *eeprom, uint16_t length,
+		       bool close = true)
+	{
+	stream_p(eeprom, length, close);
+	from_ = TCPConnection::FROM_EEPROM;
+	}
+    // The connection the packet being processed arrived on, passed
+    // back to generate().
+    byte connection() const
+	{ return current_; }
+
+    // A segment for |port| is in the buffer.
+    void receive(uint16_t len)
+	{ segment(); }
+    // Retransmit and stream on all connections.
+    void idle();
+
+    // Put up to |maxlen| bytes of the response on |conn|, from
+    // |offset| on, in |data|, and return how many. Returning less
+    // than |maxlen| ends the response. The same offset must always
+    // give the same data. Derived replaces this if it streams.
+    uint16_t generate(byte conn, uint32_t offset, byte *data,
+		      uint16_t maxlen)
+	{ return 0; }
+    void connectionOpened(byte conn)
+	{}
+
+    static const byte CONNECTIONS = 2;
 
 private:
-    virtual void packetReceived() = 0;
+    Derived &derived()
+	{ return *static_cast<Derived *>(this); }
+    // The most data we send or receive in one segment.
+    uint16_t maxData() const
+	{ return size_ - TCP_DATA_P; }
+
+    TCPConnection *find();
+    TCPConnection *allocate();
+    void open(TCPConnection &c);
+    void acked(TCPConnection &c);
+    void segment();
+    bool push(byte i);
+    void retransmit(byte i);
+    void send(TCPConnection &c, byte flags, uint32_t seq, uint16_t dlen)
+	{
+	MyIP::make_tcp_segment(buf_, c.mac, c.ip, port, c.port, seq, c.rcv,
+			       flags, maxData(),
+			       (flags & TCP_FLAGS_SYN_V) ? maxData() : 0, dlen);
+	c.sentAt = Clock::millis();
+	}
+    void sendFrom(TCPConnection &c, byte flags, uint32_t seq,
+		  uint16_t dlen);
+    void reset(TCPConnection &c)
+	{
+	send(c, TCP_FLAG_RST_V|TCP_FLAG_ACK_V, c.nxt, 0);
+	c.state = TCPConnection::CLOSED;
+	}
 
     uint16_t len_;
-    static const uint16_t BUFFER_SIZE = 1000;
-    uint8_t buf_[BUFFER_SIZE + 1];
+    bool streaming_;
+    bool keepOpen_;
+    // What stream_p() or stream_eeprom() was given.
+    byte from_;
+    const byte *blob_;
+    uint16_t length_;
+    byte current_;
+    byte victim_;
+    uint16_t iss_;
+    TCPConnection conns_[CONNECTIONS];
+    // Segments sent before waiting for an ACK.
+    static const byte MAX_IN_FLIGHT = 2;
+    // Retransmission timeout in ms, doubled on each retry.
+    static const uint16_t RTO = 500;
+    static const byte MAX_RETRIES = 5;
+    };
+
+// A TCPListener with its own poll loop, which also answers ARP and
+// pings, for when it is the only thing on the network. E.g.
+//
+//   class MyTCPServer : public TCPServer<MyTCPServer, MyIP, 80>
+//       {
+//   public:
+//       void packetReceived();
+//       };
+//
+// The frame buffer is borrowed from FramePool for each poll(), so
+// several servers can share one. Nothing is kept in it between polls.
+template <class Derived, class MyIP, uint16_t port, class Clock = NullClock>
+  class TCPServer : public TCPListener<Derived, MyIP, port, Clock>
+    {
+public:
+    void poll();
+    // False if poll() would have nothing to do, so we can sleep.
+    bool pollNeeded() const
+        { return MyIP::pollNeeded(); }
     };
 
-template <class MyIP, byte port> void TCPServer<MyIP, port>::poll()
+template <class Derived, class MyIP, uint16_t port, class Clock>
+  void TCPServer<Derived, MyIP, port, Clock>::poll()
     {
-    uint16_t plen, dat_p;
+    byte *frame = FramePool::borrow();
+    uint16_t plen;
 
-    plen = MyIP::PacketReceive(BUFFER_SIZE, buf_);
+    if (frame == 0)
+	return;
+    this->attach(frame, FramePool::FRAME_SIZE);
+
+    // Anything not for us is dropped before it is copied into frame.
+    plen = MyIP::PacketReceiveForUs(FramePool::FRAME_SIZE, frame);
 
     /* plen will be unequal to zero if there is a valid packet
        (without crc error) */
@@ -68,49 +280,332 @@ template <class MyIP, byte port> void TCPServer<MyIP, port>::poll()
 	{
 	// arp is broadcast if unknown but a host may also verify the
 	// mac address by sending it to a unicast address.
-	if(MyIP::eth_type_is_arp_and_my_ip(buf_, plen))
+	if (frame[ETH_TYPE_L_P] == ETHTYPE_ARP_L_V)
+	    ARPResponder<MyIP>::answer(frame, plen);
+	else if (frame[IP_PROTO_P] == IP_PROTO_ICMP_V)
+	    ICMPEcho<MyIP>::answer(frame, plen);
+	else if (frame[IP_PROTO_P] == IP_PROTO_TCP_V
+		 && frame[TCP_DST_PORT_H_P] == (port >> 8)
+		 && frame[TCP_DST_PORT_L_P] == (port & 0xff))
+	    this->receive(plen);
+	}
+
+    this->idle();
+
+    this->attach(0, 0);
+    FramePool::giveBack(frame);
+    }
+
+template <class Derived, class MyIP, uint16_t port, class Clock>
+  void TCPListener<Derived, MyIP, port, Clock>::idle()
+    {
+    for (byte i = 0; i < CONNECTIONS; ++i)
+	{
+	retransmit(i);
+	push(i);
+	}
+    }
+
+// The connection the segment in buf_ belongs to, if any.
+template <class Derived, class MyIP, uint16_t port, class Clock>
+  TCPConnection *TCPListener<Derived, MyIP, port, Clock>::find()
+    {
+    uint16_t src = (buf_[TCP_SRC_PORT_H_P] << 8) | buf_[TCP_SRC_PORT_L_P];
+
+    for (byte i = 0; i < CONNECTIONS; ++i)
+	{
+	TCPConnection &c = conns_[i];
+	if (c.state != TCPConnection::CLOSED && c.port == src
+	    && memcmp(c.ip, &buf_[IP_SRC_P], 4) == 0)
+	    return &c;
+	}
+    return 0;
+    }
+
+// A free connection, or if there is none the next victim.
+template <class Derived, class MyIP, uint16_t port, class Clock>
+  TCPConnection *TCPListener<Derived, MyIP, port, Clock>::allocate()
+    {
+    for (byte i = 0; i < CONNECTIONS; ++i)
+	if (conns_[i].state == TCPConnection::CLOSED)
+	    return &conns_[i];
+    TCPConnection *c = &conns_[victim_];
+    if (++victim_ == CONNECTIONS)
+	victim_ = 0;
+    return c;
+    }
+
+// Set up |c| from the SYN in buf_.
+template <class Derived, class MyIP, uint16_t port, class Clock>
+  void TCPListener<Derived, MyIP, port, Clock>::open(TCPConnection &c)
+    {
+    memcpy(c.mac, &buf_[ETH_SRC_MAC], 6);
+    memcpy(c.ip, &buf_[IP_SRC_P], 4);
+    c.port = (buf_[TCP_SRC_PORT_H_P] << 8) | buf_[TCP_SRC_PORT_L_P];
+    c.rcv = MyIP::get_u32(&buf_[TCP_SEQ_H_P]) + 1;
+    c.window = (buf_[TCP_WINDOWSIZE_H_P] << 8) | buf_[TCP_WINDOWSIZE_L_P];
+    // The default MSS, unless there is an option.
+    c.mss = 536;
+    const byte *opt = &buf_[TCP_OPTIONS_P];
+    const byte *end = &buf_[TCP_SRC_PORT_H_P] + (buf_[TCP_HEADER_LEN_P] >> 4) * 4;
+    while (opt < end && *opt != 0)
+	{
+	if (*opt == 1)
 	    {
-	    MyIP::make_arp_answer_from_request(buf_);
-	    return;
+	    ++opt;
+	    continue;
 	    }
+	if (opt + 1 >= end || opt[1] < 2)
+	    break;
+	if (*opt == 2 && opt[1] == 4)
+	    c.mss = (opt[2] << 8) | opt[3];
+	opt += opt[1];
+	}
+    if (c.mss > maxData())
+	c.mss = maxData();
+
+    iss_ += 0x1234;
+    c.una = ((uint32_t)Clock::millis() << 16) | iss_;
+    c.nxt = c.high = c.una + 1;
+    c.flags = 0;
+    c.retries = 0;
+    c.state = TCPConnection::SYN_RECEIVED;
+    derived().connectionOpened(&c - conns_);
+    }
+
+// Process the acknowledgement in buf_.
+template <class Derived, class MyIP, uint16_t port, class Clock>
+  void TCPListener<Derived, MyIP, port, Clock>::acked(TCPConnection &c)
+    {
+    uint32_t ack = MyIP::get_u32(&buf_[TCP_SEQACK_H_P]);
 
-	// check if ip packets are for us:
-	if(MyIP::eth_type_is_ip_and_my_ip(buf_, plen) == 0)
+    c.window = (buf_[TCP_WINDOWSIZE_H_P] << 8) | buf_[TCP_WINDOWSIZE_L_P];
+    if (c.state == TCPConnection::SYN_RECEIVED)
+	{
+	if (ack != c.nxt)
 	    return;
-    
-	if(buf_[IP_PROTO_P] == IP_PROTO_ICMP_V
-	   && buf_[ICMP_TYPE_P] == ICMP_TYPE_ECHOREQUEST_V)
+	c.state = TCPConnection::ESTABLISHED;
+	}
+    // Sequence numbers wrap, so compare distances from |una|.
+    if (ack == c.una || ack - c.una > c.high - c.una)
+	return;
+    c.una = ack;
+    if (c.nxt - c.una > c.high - c.una)
+	c.nxt = c.una;
+    c.retries = 0;
+    c.sentAt = Clock::millis();
+    if ((c.flags & TCPConnection::FIN_SENT) && c.una == c.fin + 1)
+	c.state = TCPConnection::CLOSED;
+    else if ((c.flags & TCPConnection::ENDED) && c.una == c.fin)
+	c.flags &= ~(TCPConnection::STREAMING | TCPConnection::KEEP_OPEN
+		     | TCPConnection::ENDED);
+    }
+
+template <class Derived, class MyIP, uint16_t port, class Clock>
+  void TCPListener<Derived, MyIP, port, Clock>::segment()
+    {
+    byte flags = buf_[TCP_FLAGS_P];
+    TCPConnection *c = find();
+
+    if (flags & TCP_FLAG_RST_V)
+	{
+	if (c)
+	    c->state = TCPConnection::CLOSED;
+	return;
+	}
+    if (flags & TCP_FLAGS_SYN_V)
+	{
+	if (!c)
+	    c = allocate();
+	open(*c);
+	send(*c, TCP_FLAGS_SYNACK_V, c->una, 0);
+	return;
+	}
+    MyIP::init_len_info(buf_); // init some data structures
+    if (c && (flags & TCP_FLAGS_ACK_V))
+	acked(*c);
+    if (!c || c->state == TCPConnection::CLOSED)
+	{
+	// A connection we have closed, possibly just now.
+	if (flags & TCP_FLAGS_FIN_V)
+	    MyIP::make_tcp_ack_from_any(buf_, port);
+	return;
+	}
+    if (c->state != TCPConnection::ESTABLISHED)
+	return;
+
+    uint16_t dlen = MyIP::get_tcp_data_len();
+    bool owe_ack = false;
+    if (dlen != 0 || (flags & TCP_FLAGS_FIN_V))
+	{
+	if (MyIP::get_u32(&buf_[TCP_SEQ_H_P]) != c->rcv
+	    || (dlen != 0 && (c->flags & TCPConnection::STREAMING)))
 	    {
-	    MyIP::make_echo_reply_from_request(buf_, plen);
+	    // Out of order or repeated, or we are still streaming the
+	    // last response, tell them what we want.
+	    send(*c, TCP_FLAG_ACK_V, c->nxt, 0);
 	    return;
 	    }
-    
-	// tcp port www start, compare only the lower byte
-	if (buf_[IP_PROTO_P] == IP_PROTO_TCP_V
-	    && buf_[TCP_DST_PORT_H_P] == 0
-	    && buf_[TCP_DST_PORT_L_P] == port)
+	owe_ack = true;
+	}
+    if (dlen != 0)
+	{
+	c->rcv += dlen;
+	current_ = c - conns_;
+	len_ = 0;
+	streaming_ = false;
+	derived().packetReceived();
+	if (len_ != 0)
 	    {
-	    if (buf_[TCP_FLAGS_P] & TCP_FLAGS_SYN_V)
-		{
-		MyIP::make_tcp_synack_from_syn(buf_, port); // make_tcp_synack_from_syn does already send the syn,ack
-		return;
-		}
-	    if (buf_[TCP_FLAGS_P] & TCP_FLAGS_ACK_V)
+	    c->fin = c->nxt + len_;
+	    c->flags |= TCPConnection::FIN_SENT;
+	    send(*c, TCP_FLAG_ACK_V|TCP_FLAG_PUSH_V|TCP_FLAG_FIN_V, c->nxt,
+		 len_);
+	    c->nxt = c->high = c->fin + 1;
+	    owe_ack = false;
+	    }
+	else if (streaming_)
+	    {
+	    c->flags |= TCPConnection::STREAMING;
+	    if (keepOpen_)
+		c->flags |= TCPConnection::KEEP_OPEN;
+	    c->flags &= ~(TCPConnection::FROM_FLASH
+			  | TCPConnection::FROM_EEPROM);
+	    c->flags |= from_;
+	    c->blob = blob_;
+	    c->length = length_;
+	    c->start = c->nxt;
+	    }
+	}
+    if (flags & TCP_FLAGS_FIN_V)
+	{
+	++c->rcv;
+	owe_ack = true;
+	if (!(c->flags & (TCPConnection::STREAMING
+			  | TCPConnection::FIN_SENT))
+	    || ((c->flags & TCPConnection::ENDED) && c->nxt == c->fin))
+	    {
+	    // Nothing more to say, close our side too.
+	    c->fin = c->nxt;
+	    c->flags |= TCPConnection::FIN_SENT;
+	    send(*c, TCP_FLAG_ACK_V|TCP_FLAG_FIN_V, c->nxt, 0);
+	    c->nxt = c->high = c->fin + 1;
+	    owe_ack = false;
+	    }
+	}
+    if (push(c - conns_))
+	owe_ack = false;
+    if (owe_ack)
+	send(*c, TCP_FLAG_ACK_V, c->nxt, 0);
+    }
+
+// Send as much of a streamed response as the window allows. Returns
+// true if anything was sent.
+template <class Derived, class MyIP, uint16_t port, class Clock>
+  bool TCPListener<Derived, MyIP, port, Clock>::push(byte i)
+    {
+    TCPConnection &c = conns_[i];
+    bool sent = false;
+
+    while (c.state == TCPConnection::ESTABLISHED
+	   && (c.flags & TCPConnection::STREAMING)
+	   && !((c.flags & TCPConnection::FIN_SENT) && c.nxt == c.fin + 1)
+	   && !((c.flags & TCPConnection::ENDED) && c.nxt == c.fin))
+	{
+	uint32_t in_flight = c.nxt - c.una;
+	if (in_flight >= (uint32_t)MAX_IN_FLIGHT * c.mss
+	    || in_flight >= c.window)
+	    break;
+	uint16_t maxlen = c.mss;
+	if (maxlen > c.window - in_flight)
+	    maxlen = c.window - in_flight;
+
+	uint32_t seq = c.nxt;
+	uint32_t offset = seq - c.start;
+	bool from = c.flags & (TCPConnection::FROM_FLASH
+			       | TCPConnection::FROM_EEPROM);
+	uint16_t dlen;
+	if (from)
+	    dlen = offset >= c.length ? 0
+	      : c.length - offset < maxlen ? c.length - offset : maxlen;
+	else
+	    dlen = derived().generate(i, offset, &buf_[TCP_DATA_P], maxlen);
+	byte flags = TCP_FLAG_ACK_V|TCP_FLAG_PUSH_V;
+	c.nxt += dlen;
+	if (dlen < maxlen)
+	    {
+	    c.fin = c.nxt;
+	    if (c.flags & TCPConnection::KEEP_OPEN)
+		c.flags |= TCPConnection::ENDED;
+	    else
 		{
-		MyIP::init_len_info(buf_); // init some data structures
-		dat_p = MyIP::get_tcp_data_pointer();
-		if (dat_p == 0)
-		    { // we can possibly have no data, just ack:
-		    if (buf_[TCP_FLAGS_P] & TCP_FLAGS_FIN_V)
-			MyIP::make_tcp_ack_from_any(buf_, port);
-		    return;
-		    }
-
-		packetReceived();
-
-		MyIP::make_tcp_ack_from_any(buf_, port); // send ack for http get
-		MyIP::make_tcp_ack_with_data(buf_, len_); // send data
+		flags |= TCP_FLAG_FIN_V;
+		c.flags |= TCPConnection::FIN_SENT;
+		++c.nxt;
 		}
 	    }
+	if (from)
+	    sendFrom(c, flags, seq, dlen);
+	else
+	    send(c, flags, seq, dlen);
+	if (c.nxt - c.una > c.high - c.una)
+	    c.high = c.nxt;
+	sent = true;
+	}
+    return sent;
+    }
+
+// Send a segment of |dlen| bytes of the response in flash or EEPROM,
+// from |seq| on.
+template <class Derived, class MyIP, uint16_t port, class Clock>
+  void TCPListener<Derived, MyIP, port, Clock>::sendFrom(TCPConnection &c,
+							 byte flags,
+							 uint32_t seq,
+							 uint16_t dlen)
+    {
+    const byte *at = c.blob + (uint16_t)(seq - c.start);
+
+    if (c.flags & TCPConnection::FROM_FLASH)
+	{
+	ProgmemSource source(at);
+	MyIP::make_tcp_segment_from(buf_, c.mac, c.ip, port, c.port, seq,
+				    c.rcv, flags, maxData(), source, dlen);
+	}
+    else
+	{
+	EEPROMSource source(at);
+	MyIP::make_tcp_segment_from(buf_, c.mac, c.ip, port, c.port, seq,
+				    c.rcv, flags, maxData(), source, dlen);
+	}
+    c.sentAt = Clock::millis();
+    }
+
+// Go back and resend anything unacknowledged for too long.
+template <class Derived, class MyIP, uint16_t port, class Clock>
+  void TCPListener<Derived, MyIP, port, Clock>::retransmit(byte i)
+    {
+    TCPConnection &c = conns_[i];
+
+    if (c.state == TCPConnection::CLOSED || c.una == c.high)
+	return;
+    if ((uint16_t)(Clock::millis() - c.sentAt) < (RTO << c.retries))
+	return;
+    if (++c.retries > MAX_RETRIES)
+	{
+	reset(c);
+	return;
+	}
+    c.sentAt = Clock::millis();
+    if (c.state == TCPConnection::SYN_RECEIVED)
+	send(c, TCP_FLAGS_SYNACK_V, c.una, 0);
+    else if (c.flags & TCPConnection::STREAMING)
+	{
+	c.nxt = c.una;
+	push(i);
 	}
+    else if ((c.flags & TCPConnection::FIN_SENT) && c.una == c.fin)
+	send(c, TCP_FLAG_ACK_V|TCP_FLAG_FIN_V, c.fin, 0);
+    else
+	// A reply built with add() is gone, give up.
+	reset(c);
     }
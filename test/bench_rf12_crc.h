@@ -0,0 +1,70 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+
+// Compares the CRC engines of crc16.h in the RF12 driver. Each
+// bench_rf12_crc_*.cc builds this with a different RF12_CRC, so the
+// sizes tracker gives what each costs in flash, and this prints the
+// cycles it takes the interrupt handler to CRC a whole frame, one
+// byte at a time as it does, and the cycles a byte, e.g.
+//
+//   crc 0x03A2 0x000D
+//
+// Timer1 counts cycles, and the loop around the update is timed on
+// its own and taken off.
+
+#include "rf12base.h"
+#include "serial.h"
+
+typedef _RF12Base<Pin::D2, Pin::B2> RF12B;
+
+SIGNAL(INT0_vect)
+    {
+    RF12B::interrupt();
+    }
+
+// volatile, so that the compiler can work neither the data nor the
+// CRC out in advance.
+static volatile byte frame[RF_MAX];
+static volatile uint16_t result;
+
+static uint16_t timeFrame(bool crc)
+    {
+    ScopedInterruptDisable sid;
+    uint16_t c = ~0;
+
+    Timer1::reset();
+    for (byte n = 0; n < RF_MAX; ++n)
+        {
+        byte b = frame[n];
+        if (crc)
+            c = RF12_CRC::update(c, b);
+        }
+    uint16_t t = Timer1::read();
+    result = c;
+    return t;
+    }
+
+int main()
+    {
+    Nanode::init();
+    Timer1::prescaler1();
+    Serial.begin(57600);
+    // The radio is running, so the driver and its engine are counted
+    // in the flash the binary takes.
+    RF12B::init(RF12B::MHZ868, true);
+
+    for (byte n = 0; n < RF_MAX; ++n)
+        frame[n] = n * 7;
+
+    for ( ; ; )
+        {
+        uint16_t cycles = timeFrame(true) - timeFrame(false);
+
+        Serial.write_P(PSTR("crc "));
+        Serial.writeHex(cycles);
+        Serial.write(' ');
+        Serial.writeHex((uint16_t)(cycles / RF_MAX));
+        Serial.write_P(PSTR("\r\n"));
+        for (uint16_t t = Clock16::millis(); Clock16::millis() - t < 2000; )
+            RF12B::recvDone();
+        }
+    }
@@ -0,0 +1,4 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+// See bench_rf12_crc.h.
+#define RF12_CRC CRC16Nibble
+#include "bench_rf12_crc.h"
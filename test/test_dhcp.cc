@@ -0,0 +1,47 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+#include "ip.h"
+#include "dhcp.h"
+#include "clock16.h"
+
+// Nanode
+typedef ENC28J60<Pin::B0> Ethernet;
+
+typedef IP<Ethernet> MyIP;
+
+static uint8_t mymac[6] = {0x54,0x55,0x58,0x10,0x00,0x24};
+// Filled in by DHCP.
+static uint8_t myip[4];
+
+typedef DHCPClient<MyIP, Clock16> MyDHCP;
+
+// A UDP echo server on whatever address we are given.
+class MyUDPListener : public UDPListener<MyUDPListener, MyIP, 7>
+    {
+public:
+    void datagramReceived()
+	{
+	setLength(dataLength());
+	reply();
+	}
+    };
+
+typedef NetList<ARPResponder<MyIP>,
+	NetList<ICMPEcho<MyIP>,
+	NetList<MyDHCP,
+	NetList<MyUDPListener> > > > Handlers;
+
+int main()
+    {
+    NetStack<MyIP, Handlers> net;
+
+    Nanode::init();
+
+    Ethernet::setup(mymac);
+    MyIP::init_ip_arp_udp_tcp(mymac, myip);
+    net.get<MyDHCP>().start();
+
+    for ( ; ; )
+	net.poll();
+
+    return 0;
+    }
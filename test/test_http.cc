@@ -0,0 +1,87 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+#include "ip.h"
+#include "tcp_server.h"
+#include "http.h"
+#include "clock16.h"
+
+// Nanode
+typedef ENC28J60<Pin::B0> Ethernet;
+
+typedef IP<Ethernet> MyIP;
+
+static uint8_t mymac[6] = {0x54,0x55,0x58,0x10,0x00,0x24};
+static uint8_t myip[4] = {192,168,1,111};
+
+// A page at / and the uptime at /metrics. A poller can fetch /metrics
+// over and over on one connection.
+class MyWeb : public HTTPServer<MyWeb, TCPServer<MyWeb, MyIP, 80, Clock16> >
+    {
+public:
+    enum { ROOT, METRICS };
+    static const char *const ROUTES[];
+
+    // The uptime is read once per request, so that a retransmitted
+    // segment has the same digits.
+    void requestComplete(byte conn)
+	{ uptime_[conn] = Clock16::millis(); }
+    uint16_t body(byte conn, uint32_t offset, byte *data, uint16_t maxlen);
+
+private:
+    uint16_t uptime_[CONNECTIONS];
+    };
+
+static const char root_path[] PROGMEM = "/";
+static const char metrics_path[] PROGMEM = "/metrics";
+const char *const MyWeb::ROUTES[] PROGMEM = { root_path, metrics_path, 0 };
+
+static const char page[] PROGMEM =
+    "Hi mum\n";
+static const char metric[] PROGMEM =
+    "uptime_ms ";
+
+uint16_t MyWeb::body(byte conn, uint32_t offset, byte *data, uint16_t maxlen)
+    {
+    const char *text = request(conn).route() == ROOT ? page : metric;
+    uint16_t n;
+
+    for (n = 0; n < maxlen; ++n, ++offset)
+	{
+	char c = 0;
+
+	if (offset < strlen_P(text))
+	    c = pgm_read_byte(&text[offset]);
+	else if (text == metric)
+	    {
+	    // Five digits with leading zeroes, then a newline.
+	    uint32_t digit = offset - strlen_P(text);
+	    if (digit < 5)
+		{
+		uint16_t d = uptime_[conn];
+		for (byte i = digit; i < 4; ++i)
+		    d /= 10;
+		c = '0' + d % 10;
+		}
+	    else if (digit == 5)
+		c = '\n';
+	    }
+	if (c == 0)
+	    break;
+	data[n] = c;
+	}
+    return n;
+    }
+
+int main()
+    {
+    MyWeb web;
+
+    Nanode::init();
+
+    Ethernet::setup(mymac);
+    MyIP::init_ip_arp_udp_tcp(mymac, myip);
+
+    for ( ; ; )
+	web.poll();
+
+    return 0;
+    }
@@ -8,7 +8,7 @@ typedef ENC28J60<Pin::B0> Ethernet;
 
 typedef IP<Ethernet> MyIP;
 
-static uint16_t mywwwport = 80; // listen port for tcp/www (max range 1-254)
+static uint16_t mywwwport = 80; // listen port for tcp/www
 
 #define BUFFER_SIZE 500
 static uint8_t buf[BUFFER_SIZE+1];
@@ -144,10 +144,10 @@ void loop()
 	    return;
 	    }
     
-	// tcp port www start, compare only the lower byte
+	// tcp port www start
 	if (buf[IP_PROTO_P] == IP_PROTO_TCP_V
-	    && buf[TCP_DST_PORT_H_P] == 0
-	    && buf[TCP_DST_PORT_L_P] == mywwwport)
+	    && buf[TCP_DST_PORT_H_P] == (mywwwport >> 8)
+	    && buf[TCP_DST_PORT_L_P] == (mywwwport & 0xff))
 	    {
 	    if (buf[TCP_FLAGS_P] & TCP_FLAGS_SYN_V)
 		{
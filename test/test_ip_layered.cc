@@ -21,8 +21,9 @@ void setup()
     MyIP::init_ip_arp_udp_tcp(mymac, myip);
     }
 
-class MyTCPServer : public TCPServer<MyIP, 80>
+class MyTCPServer : public TCPServer<MyTCPServer, MyIP, 80>
     {
+public:
     void packetReceived();
     };
 
@@ -38,9 +39,6 @@ void MyTCPServer::packetReceived()
 	add_p(PSTR("HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\nHi mum"));
     }
 
-// FIXME: why do I need this?
-extern "C" void __cxa_pure_virtual() { while (1); }
-
 int main()
     {
     MyTCPServer tcp;
@@ -0,0 +1,73 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+#include <string.h>
+#include "ip.h"
+#include "tcp_server.h"
+
+// Nanode, with the ENC28J60's INT line wired to D3.
+typedef ENC28J60<Pin::B0, Pin::D3> Ethernet;
+
+typedef IP<Ethernet> MyIP;
+
+static uint8_t mymac[6] = {0x54,0x55,0x58,0x10,0x00,0x24}; 
+static uint8_t myip[4] = {192,168,1,111};
+
+typedef Pin::D6 LED;
+
+class MyTCPServer : public TCPServer<MyTCPServer, MyIP, 80>
+    {
+public:
+    void packetReceived();
+    };
+
+void MyTCPServer::packetReceived()
+    {
+    clearBuffer();
+    char *buf = getData();
+    if (strncmp("GET / ", buf, 6) != 0)
+	add_p(PSTR("HTTP/1.0 501 Not OK\r\nContent-Type: text/html\r\n\r\n"));
+    else
+	add_p(PSTR("HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\nZzz"));
+    }
+
+
+SIGNAL(PCINT2_vect)
+    {
+    Ethernet::interrupt();
+    }
+
+int main()
+    {
+    MyTCPServer tcp;
+
+    Nanode::init();
+
+    LED::set();
+    LED::modeOutput();
+
+    Ethernet::setup(mymac);
+    MyIP::init_ip_arp_udp_tcp(mymac, myip);
+
+    set_sleep_mode(SLEEP_MODE_IDLE);
+
+    for ( ; ; )
+	{
+	cli();
+	if (tcp.pollNeeded())
+	    {
+	    sei();
+	    tcp.poll();
+	    }
+	else
+	    {
+	    // Sleep until a packet arrives
+	    sleep_enable();
+	    LED::clear();
+	    sei();
+	    sleep_cpu();
+	    sleep_disable();
+	    LED::set();
+	    }
+	}
+
+    return 0;
+    }
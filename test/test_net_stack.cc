@@ -0,0 +1,84 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+#include <string.h>
+#include "ip.h"
+#include "net_stack.h"
+#include "tcp_server.h"
+#include "udp_socket.h"
+#include "clock16.h"
+
+// Nanode
+typedef ENC28J60<Pin::B0> Ethernet;
+
+typedef IP<Ethernet> MyIP;
+
+static uint8_t mymac[6] = {0x54,0x55,0x58,0x10,0x00,0x24};
+static uint8_t myip[4] = {192,168,1,111};
+
+// A web server, a metrics endpoint and a UDP echo server sharing one
+// frame buffer.
+class MyTCPListener : public TCPListener<MyTCPListener, MyIP, 80, Clock16>
+    {
+public:
+    void packetReceived();
+    };
+
+void MyTCPListener::packetReceived()
+    {
+    clearBuffer();
+    if (strncmp("GET / ", getData(), 6) != 0)
+	add_p(PSTR("HTTP/1.0 501 Not OK\r\nContent-Type: text/html\r\n\r\n"));
+    else
+	add_p(PSTR("HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\nHi mum"));
+    }
+
+class MetricsListener : public TCPListener<MetricsListener, MyIP, 9100,
+					   Clock16>
+    {
+public:
+    void packetReceived()
+	{
+	clearBuffer();
+	add_p(PSTR("HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n"
+		   "uptime_ms "));
+	uint16_t t = Clock16::millis();
+	char digits[6];
+	byte n = 0;
+	do
+	    digits[n++] = '0' + t % 10;
+	while ((t /= 10) != 0);
+	while (n != 0)
+	    add((const byte *)&digits[--n], 1);
+	add("\n");
+	}
+    };
+
+class MyUDPListener : public UDPListener<MyUDPListener, MyIP, 7>
+    {
+public:
+    void datagramReceived()
+	{
+	setLength(dataLength());
+	reply();
+	}
+    };
+
+typedef NetList<ARPResponder<MyIP>,
+	NetList<ICMPEcho<MyIP>,
+	NetList<MyUDPListener,
+	NetList<MyTCPListener,
+	NetList<MetricsListener> > > > > Handlers;
+
+int main()
+    {
+    NetStack<MyIP, Handlers> net;
+
+    Nanode::init();
+
+    Ethernet::setup(mymac);
+    MyIP::init_ip_arp_udp_tcp(mymac, myip);
+
+    for ( ; ; )
+	net.poll();
+
+    return 0;
+    }
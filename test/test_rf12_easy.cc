@@ -0,0 +1,39 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+#include "rf12jeelabs.h"
+#include "clock16.h"
+
+// A battery node: sends a counter by easy transmission, to be acked
+// by e.g. test_rf12_layered with its id set to 1, and sleeps in
+// between, with the radio's wake-up timer waking the CPU.
+
+static const byte id = 2;
+
+int main()
+    {
+    byte count = 0;
+
+    Nanode::init();
+
+    RF12B::init(id, RF12B::MHZ868);
+    RF12B::easyInit(0);
+
+    for ( ; ; )
+        {
+        byte data[2] = { ++count, RF12B::lowbat() };
+        RF12B::easySend(data, sizeof data);
+
+        // Send, and resend until acked, asleep through each packet
+        // and idle in between.
+        while (RF12B::easyPoll() != 0)
+            {
+            RF12B::sendWait(RF12B::WAIT_STANDBY);
+            Clock16::sleep(10);
+            }
+
+        // About 8 seconds with the radio and the CPU off.
+        RF12B::sleep(250);
+        set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+        sleep_mode();
+        RF12B::wakeup();
+        }
+    }
@@ -3,6 +3,8 @@
 #include "rf12star.h"
 #include "serial.h"
 #include "tcp_server.h"
+#include "http.h"
+#include "clock16.h"
 
 class SerialObserver
     {
@@ -42,11 +44,20 @@ typedef ENC28J60<Pin::B0> Ethernet;
 
 typedef IP<Ethernet> MyIP;
 
-class MyTCPServer : public TCPServer<MyIP, 80>
+class MyWeb : public HTTPServer<MyWeb, TCPServer<MyWeb, MyIP, 80, Clock16> >
     {
-    void packetReceived();
+public:
+    enum { LAST };
+    static const char *const ROUTES[];
+
+    const char *contentType(byte conn)
+	{ return PSTR("application/octet-stream"); }
+    uint16_t body(byte conn, uint32_t offset, byte *data, uint16_t maxlen);
     };
 
+static const char last_path[] PROGMEM = "/";
+const char *const MyWeb::ROUTES[] PROGMEM = { last_path, 0 };
+
 inline byte min(byte a, byte b)
     {
     if (a < b)
@@ -75,12 +86,24 @@ public:
 	    }
 	}
 
-    static void send(MyTCPServer *tcp)
+    // The last message: its sequence number, length and data, from
+    // |offset| on.
+    static uint16_t read(uint32_t offset, byte *data, uint16_t maxlen)
 	{
-	tcp->add_p(PSTR("HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n\r\n"));
-	tcp->add((byte *)&sequence_, sizeof sequence_);
-	tcp->add((byte *)length_, sizeof length_);
-	tcp->add(save_, min(length_, sizeof save_));
+	uint16_t n;
+
+	for (n = 0; n < maxlen; ++n, ++offset)
+	    {
+	    if (offset < sizeof sequence_)
+		data[n] = ((const byte *)&sequence_)[offset];
+	    else if (offset == sizeof sequence_)
+		data[n] = length_;
+	    else if (offset - sizeof sequence_ - 1 < min(length_, SAVE))
+		data[n] = save_[offset - sizeof sequence_ - 1];
+	    else
+		break;
+	    }
+	return n;
 	}
 
 
@@ -109,29 +132,15 @@ void setup()
     MyIP::init_ip_arp_udp_tcp(mymac, myip);
     }
 
-void MyTCPServer::packetReceived()
-    {
-    clearBuffer();
-    char *buf = getData();
-    if (strncmp("GET / ", buf, 6) != 0)
-	// head, post and other methods for possible status codes see:
-	// http://www.w3.org/Protocols/rfc2616/rfc2616-sec10.html
-	add_p(PSTR("HTTP/1.0 501 Not OK\r\nContent-Type: text/html\r\n\r\n"));
-    else
-	Processor::send(this);
-    }
-
-// FIXME: why do I need this?
-extern "C" void __cxa_pure_virtual()
+// A poller can keep its connection open between samples.
+uint16_t MyWeb::body(byte conn, uint32_t offset, byte *data, uint16_t maxlen)
     {
-    Serial.write("Ooops!");
-    for( ; ; )
-	;
+    return Processor::read(offset, data, maxlen);
     }
 
 int main()
     {
-    MyTCPServer tcp;
+    MyWeb web;
 
     Arduino::init();
     Serial.begin(57600);
@@ -143,6 +152,6 @@ int main()
     for ( ; ; )
 	{
 	Master::poll();
-	tcp.poll();
+	web.poll();
 	}
     }
@@ -0,0 +1,79 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+#include <string.h>
+#include "ip.h"
+#include "tcp_server.h"
+#include "clock16.h"
+
+// Nanode
+typedef ENC28J60<Pin::B0> Ethernet;
+
+typedef IP<Ethernet> MyIP;
+
+static uint8_t mymac[6] = {0x54,0x55,0x58,0x10,0x00,0x24};
+static uint8_t myip[4] = {192,168,1,111};
+
+// The whole response, headers and all, with the page gzipped (gzip -9)
+// so that browsers unpack it. It is sent from flash as it is.
+static const byte page[] PROGMEM =
+    {
+    'H', 'T', 'T', 'P', '/', '1', '.', '0', ' ', '2', '0', '0', ' ', 'O',
+    'K', '\r', '\n',
+    'C', 'o', 'n', 't', 'e', 'n', 't', '-', 'T', 'y', 'p', 'e', ':', ' ',
+    't', 'e', 'x', 't', '/', 'h', 't', 'm', 'l', '\r', '\n',
+    'C', 'o', 'n', 't', 'e', 'n', 't', '-', 'E', 'n', 'c', 'o', 'd', 'i',
+    'n', 'g', ':', ' ', 'g', 'z', 'i', 'p', '\r', '\n',
+    '\r', '\n',
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x6d, 0x90,
+    0xc1, 0x4e, 0xc3, 0x30, 0x0c, 0x86, 0xef, 0x7d, 0x0a, 0x73, 0x67, 0x64,
+    0x2d, 0x12, 0x9a, 0x4a, 0x54, 0x09, 0xca, 0x38, 0x20, 0x6d, 0xa0, 0xa9,
+    0x1c, 0x76, 0xf4, 0x88, 0x9b, 0x44, 0xb4, 0x69, 0xd4, 0xf8, 0x52, 0x26,
+    0xde, 0x9d, 0x74, 0x11, 0x15, 0x07, 0x4e, 0xb6, 0x7f, 0x7d, 0xf6, 0x6f,
+    0x5b, 0x5e, 0x3d, 0xbd, 0xd6, 0xcd, 0xf1, 0x6d, 0x0b, 0x86, 0xfb, 0xae,
+    0xca, 0xe4, 0x25, 0x48, 0x43, 0xa8, 0x2a, 0xc9, 0x96, 0x3b, 0xaa, 0xf6,
+    0xe8, 0x06, 0x45, 0x52, 0xa4, 0x2a, 0x93, 0x81, 0xa7, 0x18, 0x4f, 0x83,
+    0x9a, 0xce, 0xed, 0xe0, 0x78, 0xd5, 0x62, 0x6f, 0xbb, 0xa9, 0x0c, 0xe8,
+    0xc2, 0x2a, 0xd0, 0x68, 0xdb, 0xfb, 0x1e, 0x47, 0x6d, 0x5d, 0x59, 0x50,
+    0xff, 0xcd, 0xea, 0xec, 0x51, 0x29, 0xeb, 0x74, 0xb9, 0x86, 0x3c, 0x0a,
+    0x52, 0xa4, 0xfe, 0x4c, 0x8a, 0x64, 0x32, 0x0f, 0x8a, 0x86, 0xf9, 0xe2,
+    0x13, 0xd3, 0x4c, 0xfa, 0xaa, 0x31, 0x36, 0x80, 0x47, 0x4d, 0x10, 0xe3,
+    0x27, 0x79, 0x06, 0xfd, 0x65, 0xbd, 0x27, 0x05, 0xd6, 0x41, 0xdb, 0x61,
+    0x30, 0xd7, 0x80, 0x4e, 0x41, 0x20, 0xc7, 0x10, 0x78, 0x44, 0xab, 0x0d,
+    0x43, 0x3b, 0x0e, 0x3d, 0xb0, 0xa1, 0x91, 0x32, 0x1e, 0xe6, 0x04, 0xb6,
+    0x73, 0xe5, 0x88, 0xe1, 0xc3, 0x58, 0x7f, 0x23, 0x85, 0x8f, 0xd3, 0x19,
+    0x4f, 0x97, 0x15, 0x78, 0x8c, 0x47, 0xaa, 0xea, 0x17, 0x89, 0x37, 0xaa,
+    0x24, 0xec, 0xeb, 0x62, 0xf3, 0x72, 0xb7, 0x4e, 0x82, 0x88, 0xd8, 0xc2,
+    0x1e, 0x50, 0xd9, 0x61, 0x01, 0x0f, 0xcf, 0xbb, 0xbc, 0x78, 0xfc, 0x07,
+    0xdb, 0xd5, 0xef, 0x0b, 0xf4, 0xd0, 0xf4, 0xa4, 0xf1, 0xb6, 0xd8, 0xf8,
+    0xbf, 0xa0, 0x48, 0x4b, 0x48, 0x91, 0x1e, 0x20, 0xd2, 0xff, 0x7f, 0x00,
+    0x45, 0xe8, 0xee, 0xe9, 0x90, 0x01, 0x00, 0x00
+    };
+
+class MyTCPServer : public TCPServer<MyTCPServer, MyIP, 80, Clock16>
+    {
+public:
+    void packetReceived();
+    };
+
+void MyTCPServer::packetReceived()
+    {
+    clearBuffer();
+    if (strncmp("GET / ", getData(), 6) != 0)
+	add_p(PSTR("HTTP/1.0 501 Not OK\r\nContent-Type: text/html\r\n\r\n"));
+    else
+	stream_p(page, sizeof page);
+    }
+
+int main()
+    {
+    MyTCPServer tcp;
+
+    Nanode::init();
+
+    Ethernet::setup(mymac);
+    MyIP::init_ip_arp_udp_tcp(mymac, myip);
+
+    for( ; ; )
+	tcp.poll();
+
+    return 0;
+    }
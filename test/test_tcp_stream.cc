@@ -0,0 +1,84 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+#include <string.h>
+#include "ip.h"
+#include "tcp_server.h"
+#include "clock16.h"
+
+// Nanode
+typedef ENC28J60<Pin::B0> Ethernet;
+
+typedef IP<Ethernet> MyIP;
+
+static uint8_t mymac[6] = {0x54,0x55,0x58,0x10,0x00,0x24}; 
+static uint8_t myip[4] = {192,168,1,111};
+
+static const char header[] PROGMEM =
+    "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n";
+// The body is LINES lines of "line nnnn\r\n", far more than fits in
+// one packet.
+static const uint16_t LINES = 500;
+static const byte LINE_LENGTH = 11;
+
+class MyTCPServer : public TCPServer<MyTCPServer, MyIP, 80, Clock16>
+    {
+public:
+    void packetReceived();
+    uint16_t generate(byte conn, uint32_t offset, byte *data,
+		      uint16_t maxlen);
+    };
+
+void MyTCPServer::packetReceived()
+    {
+    clearBuffer();
+    if (strncmp("GET / ", getData(), 6) != 0)
+	add_p(PSTR("HTTP/1.0 501 Not OK\r\nContent-Type: text/html\r\n\r\n"));
+    else
+	stream();
+    }
+
+// Works out each byte from its offset, so nothing is stored.
+uint16_t MyTCPServer::generate(byte conn, uint32_t offset, byte *data,
+			       uint16_t maxlen)
+    {
+    const uint32_t total = (sizeof header - 1)
+      + (uint32_t)LINES * LINE_LENGTH;
+    uint16_t n;
+
+    for (n = 0; n < maxlen && offset < total; ++n, ++offset)
+	{
+	if (offset < sizeof header - 1)
+	    {
+	    data[n] = pgm_read_byte(&header[offset]);
+	    continue;
+	    }
+	uint16_t line = (offset - (sizeof header - 1)) / LINE_LENGTH;
+	byte col = (offset - (sizeof header - 1)) % LINE_LENGTH;
+	if (col < 5)
+	    data[n] = "line "[col];
+	else if (col < 9)
+	    {
+	    uint16_t d = line;
+	    for (byte i = col; i < 8; ++i)
+		d /= 10;
+	    data[n] = '0' + d % 10;
+	    }
+	else
+	    data[n] = col == 9 ? '\r' : '\n';
+	}
+    return n;
+    }
+
+int main()
+    {
+    MyTCPServer tcp;
+
+    Nanode::init();
+
+    Ethernet::setup(mymac);
+    MyIP::init_ip_arp_udp_tcp(mymac, myip);
+
+    for( ; ; )
+	tcp.poll();
+
+    return 0;
+    }
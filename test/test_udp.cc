@@ -0,0 +1,59 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+// Park a report while the collector's MAC address is looked up.
+#define ENC28J60_PARK_SLOTS 1
+#include "ip.h"
+#include "udp_socket.h"
+#include "clock16.h"
+
+// Nanode
+typedef ENC28J60<Pin::B0> Ethernet;
+
+typedef IP<Ethernet> MyIP;
+
+static uint8_t mymac[6] = {0x54,0x55,0x58,0x10,0x00,0x24};
+static uint8_t myip[4] = {192,168,1,111};
+static uint8_t gateway[4] = {192,168,1,1};
+static uint8_t netmask[4] = {255,255,255,0};
+// Where the telemetry goes.
+static uint8_t collector[4] = {192,168,1,10};
+static const uint16_t COLLECTOR_PORT = 9000;
+
+// Echoes anything sent to port 7, and sends a report to the
+// collector once a second.
+int main()
+    {
+    UDPSocket<MyIP, 7> udp;
+    uint16_t sequence = 0;
+
+    Nanode::init();
+
+    Ethernet::setup(mymac);
+    MyIP::init_ip_arp_udp_tcp(mymac, myip);
+    MyIP::set_gateway(gateway, netmask);
+
+    uint16_t last = Clock16::millis();
+    for ( ; ; )
+	{
+	if (udp.poll())
+	    {
+	    udp.setLength(udp.dataLength());
+	    udp.reply();
+	    }
+
+	if ((uint16_t)(Clock16::millis() - last) >= 1000)
+	    {
+	    last += 1000;
+	    MyIP::tick();
+	    // Built in place, so nothing is copied. The first report goes
+	    // out once the collector answers our ARP request.
+	    udp.clearBuffer();
+	    udp.add_p(PSTR("seq "));
+	    udp.add16(sequence++);
+	    udp.add_p(PSTR(" uptime "));
+	    udp.add16(Clock16::millis());
+	    udp.sendTo(collector, COLLECTOR_PORT);
+	    }
+	}
+
+    return 0;
+    }
@@ -256,13 +256,12 @@ static byte base[] = {
 
 static byte buf[sizeof base];
 
-class MyTCPServer : public TCPServer<MyIP, 222>
+class MyTCPServer : public TCPServer<MyTCPServer, MyIP, 222>
     {
 public:
     MyTCPServer() : offset_(0)
 	{}
 
-private:
     void packetReceived()
 	{
 	byte acks = 0;
@@ -298,6 +297,7 @@ private:
 	    add((byte *)".", 1);
 	}
 
+private:
     size_t offset_;
     };
 
@@ -359,10 +359,3 @@ int main(void)
 	    }
 	}
     }
-
-// FIXME: why do I need this?
-extern "C" void __cxa_pure_virtual()
-    {
-    for( ; ; )
-	;
-    }
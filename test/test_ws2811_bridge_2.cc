@@ -23,13 +23,12 @@ static byte base[] = {
 
 static byte buf[sizeof base + 3];
 
-class MyTCPServer : public TCPServer<MyIP, 222>
+class MyTCPServer : public TCPServer<MyTCPServer, MyIP, 222>
     {
 public:
     MyTCPServer() : offset_(0)
 	{}
 
-private:
     void packetReceived()
 	{
 	byte acks = 0;
@@ -71,6 +70,7 @@ private:
 
 	}
 
+private:
     size_t offset_;
     };
 
@@ -110,10 +110,3 @@ int main(void)
 	WS2811RGB((RGB_t *)buf, sizeof buf/3);
 	}
     }
-
-// FIXME: why do I need this?
-extern "C" void __cxa_pure_virtual()
-    {
-    for( ; ; )
-	;
-    }
@@ -0,0 +1,258 @@
+// -*- mode: c++; indent-tabs-mode: nil; -*-
+
+#ifndef UDP_SOCKET_H
+#define UDP_SOCKET_H
+
+#include <avr/pgmspace.h>
+#include "net_stack.h"
+
+// UDP on |port|, in a frame buffer given with attach(). A datagram is
+// built in place in the buffer with add() and friends, or written
+// straight to payload(), and sent with sendTo() or reply(). Nothing
+// is copied on the way to the Ethernet chip, and the payload can be
+// as long as the buffer allows, up to MAX_PAYLOAD for a buffer of
+// ETH_HEADER_LEN + 1500 bytes.
+//
+// See UDPSocket and UDPListener below for how datagrams come in.
+// Broadcasts only come in after MyIP::listen_broadcasts(true).
+template <class MyIP, uint16_t port> class UDPEndpoint : public NetHandler
+    {
+public:
+    UDPEndpoint()
+      : len_(0)
+	{}
+
+    // The received datagram, see poll().
+    const byte *data() const
+	{ return &buf_[UDP_DATA_P]; }
+    // 0 if the UDP length is shorter than the header, which
+    // complete() doesn't accept anyway.
+    uint16_t dataLength() const
+	{
+	uint16_t ulen = (buf_[UDP_LEN_H_P] << 8) | buf_[UDP_LEN_L_P];
+	return ulen < UDP_HEADER_LEN ? 0 : ulen - UDP_HEADER_LEN;
+	}
+    const uint8_t *peerIP() const
+	{ return &buf_[IP_SRC_P]; }
+    uint16_t peerPort() const
+	{ return (buf_[UDP_SRC_PORT_H_P] << 8) | buf_[UDP_SRC_PORT_L_P]; }
+
+    // The payload being built. Write up to maxLength() bytes here and
+    // set the length with setLength(), or use add().
+    byte *payload()
+	{ return &buf_[UDP_DATA_P]; }
+    uint16_t maxLength() const
+	{ return size_ > UDP_DATA_P ? size_ - UDP_DATA_P : 0; }
+    void setLength(uint16_t len)
+	{ len_ = len; }
+    uint16_t length() const
+	{ return len_; }
+    void clearBuffer()
+	{ len_ = 0; }
+
+    void add(byte b)
+	{
+	if (len_ < maxLength())
+	    buf_[UDP_DATA_P + len_++] = b;
+	}
+    void add(const byte *data, uint16_t length)
+	{
+	while (length--)
+	    add(*data++);
+	}
+    void add(const char *str)
+	{
+	while (*str)
+	    add(*str++);
+	}
+    void add_p(const char *pmem)
+	{
+	char c;
+
+	while ((c = pgm_read_byte(pmem++)))
+	    add(c);
+	}
+    // Big endian, like the rest of the packet.
+    void add16(uint16_t w)
+	{
+	add(w >> 8);
+	add(w & 0xff);
+	}
+
+    // Send the payload to |port| on |ip|, the next hop being found
+    // with MyIP's ARP cache. Returns false if it wasn't sent yet, in
+    // which case it may have been dropped, see IP::send_routed().
+    bool sendTo(const uint8_t *ip, uint16_t dport)
+	{
+	MyIP::make_eth_ip_new(buf_, 0);
+	MyIP::make_ip_new(buf_, IP_HEADER_LEN + UDP_HEADER_LEN + len_, ip,
+			  IP_PROTO_UDP_V);
+	header(dport);
+	bool sent = MyIP::send_routed(buf_, UDP_DATA_P + len_,
+				      UDP_CHECKSUM_H_P,
+				      IP_PROTO_UDP_V + UDP_HEADER_LEN + len_);
+	len_ = 0;
+	return sent;
+	}
+    // Send the payload back to where the datagram being processed
+    // came from. The payload overwrites the received data.
+    void reply()
+	{
+	uint16_t dport = peerPort();
+	uint16_t len = IP_HEADER_LEN + UDP_HEADER_LEN + len_;
+
+	MyIP::make_eth(buf_);
+	buf_[IP_TOTLEN_H_P] = len >> 8;
+	buf_[IP_TOTLEN_L_P] = len & 0xff;
+	MyIP::make_ip(buf_);
+	header(dport);
+	MyIP::send_checksummed(buf_, UDP_DATA_P + len_, UDP_CHECKSUM_H_P,
+			       IP_PROTO_UDP_V + UDP_HEADER_LEN + len_);
+	len_ = 0;
+	}
+
+    // The most we can send in one unfragmented datagram.
+    static const uint16_t MAX_PAYLOAD = 1500 - IP_HEADER_LEN - UDP_HEADER_LEN;
+
+protected:
+    // True if the received datagram wasn't cut short by the buffer,
+    // and its UDP length covers at least the header.
+    bool complete(uint16_t plen) const
+	{
+	uint16_t ulen = (buf_[UDP_LEN_H_P] << 8) | buf_[UDP_LEN_L_P];
+	return plen >= UDP_DATA_P && ulen >= UDP_HEADER_LEN
+	  && ulen - UDP_HEADER_LEN <= plen - UDP_DATA_P;
+	}
+
+private:
+    void header(uint16_t dport)
+	{
+	uint16_t ulen = UDP_HEADER_LEN + len_;
+
+	buf_[UDP_SRC_PORT_H_P] = port >> 8;
+	buf_[UDP_SRC_PORT_L_P] = port & 0xff;
+	buf_[UDP_DST_PORT_H_P] = dport >> 8;
+	buf_[UDP_DST_PORT_L_P] = dport & 0xff;
+	buf_[UDP_LEN_H_P] = ulen >> 8;
+	buf_[UDP_LEN_L_P] = ulen & 0xff;
+	}
+
+    uint16_t len_;
+    };
+
+// A UDP handler for NetStack (see net_stack.h). Each datagram for
+// |port| calls datagramReceived() in |Derived|, which must be public.
+// A datagram cut short by the buffer is dropped. The buffer is only
+// there during NetStack::poll(), so datagrams of our own are sent
+// from an idle() in Derived.
+template <class Derived, class MyIP, uint16_t port>
+  class UDPListener : public UDPEndpoint<MyIP, port>
+    {
+public:
+    static const uint16_t ETHERTYPE = ETHTYPE_IP_V;
+    static const byte PROTOCOL = IP_PROTO_UDP_V;
+    static const uint16_t PORT = port;
+
+    void receive(uint16_t len)
+	{
+	if (this->complete(len))
+	    static_cast<Derived *>(this)->datagramReceived();
+	}
+    };
+
+// A UDP socket with its own poll loop, for when it is the only thing
+// on the network. poll() receives a packet, answers ARP and pings,
+// and returns true if it is a datagram for |port|:
+//
+//   if (udp.poll())
+//       {
+//       udp.setLength(udp.dataLength());
+//       udp.reply();    // echo
+//       }
+//
+// The frame buffer is borrowed from FramePool, by poll() or
+// clearBuffer(), and kept until the datagram is sent or the next
+// poll(). If none is free, nothing is received and add() does
+// nothing.
+template <class MyIP, uint16_t port>
+  class UDPSocket : public UDPEndpoint<MyIP, port>
+    {
+    typedef UDPEndpoint<MyIP, port> Endpoint;
+
+public:
+    // Returns true if a datagram for us was received.
+    bool poll();
+    // False if poll() would have nothing to do, so we can sleep.
+    bool pollNeeded() const
+        { return MyIP::pollNeeded(); }
+
+    // Start a datagram of our own.
+    void clearBuffer()
+	{
+	borrow();
+	Endpoint::clearBuffer();
+	}
+    bool sendTo(const uint8_t *ip, uint16_t dport)
+	{
+	bool sent = borrow() && Endpoint::sendTo(ip, dport);
+
+	giveBack();
+	return sent;
+	}
+    void reply()
+	{
+	if (borrow())
+	    Endpoint::reply();
+	giveBack();
+	}
+
+private:
+    bool borrow()
+	{
+	if (this->buf_ == 0)
+	    {
+	    byte *frame = FramePool::borrow();
+
+	    if (frame != 0)
+		this->attach(frame, FramePool::FRAME_SIZE);
+	    }
+	return this->buf_ != 0;
+	}
+    void giveBack()
+	{
+	if (this->buf_ != 0)
+	    {
+	    FramePool::giveBack(this->buf_);
+	    this->attach(0, 0);
+	    }
+	}
+    };
+
+template <class MyIP, uint16_t port> bool UDPSocket<MyIP, port>::poll()
+    {
+    giveBack();
+    if (!borrow())
+	return false;
+
+    byte *frame = this->buf_;
+    uint16_t plen = MyIP::PacketReceiveForUs(FramePool::FRAME_SIZE, frame);
+
+    if (plen != 0)
+	{
+	if (frame[ETH_TYPE_L_P] == ETHTYPE_ARP_L_V)
+	    ARPResponder<MyIP>::answer(frame, plen);
+	else if (frame[IP_PROTO_P] == IP_PROTO_ICMP_V)
+	    ICMPEcho<MyIP>::answer(frame, plen);
+	// A datagram cut short by our buffer is dropped.
+	else if (frame[IP_PROTO_P] == IP_PROTO_UDP_V
+		 && frame[UDP_DST_PORT_H_P] == (port >> 8)
+		 && frame[UDP_DST_PORT_L_P] == (port & 0xff)
+		 && this->complete(plen))
+	    return true;
+	}
+
+    giveBack();
+    return false;
+    }
+
+#endif